@@ -0,0 +1,465 @@
+//! Extracts a bbox sub-archive from an existing osmflat archive.
+//!
+//! Walks the mmap'd source archive instead of re-decoding PBF: nodes inside
+//! the bbox are kept, ways with at least one kept node are kept together
+//! with their remaining nodes (so geometries stay complete), and relations
+//! are kept if any member is kept. All indices are remapped into the compact
+//! output archive; references to dropped entities become unresolved, like
+//! references leaving a clipped PBF extract.
+
+use colored::Colorize;
+use flatdata::FileResourceStorage;
+use log::info;
+use osmflat::{Osm, RelationMembersRef, COORD_SCALE};
+use structopt::StructOpt;
+
+use std::collections::HashMap;
+use std::io;
+use std::ops::Range;
+use std::path::PathBuf;
+use std::str::FromStr;
+
+type Error = Box<dyn std::error::Error>;
+
+/// Geographic bounding box with coordinates scaled with `COORD_SCALE`.
+#[derive(Debug, Clone, Copy)]
+struct Bbox {
+    left: i64,
+    bottom: i64,
+    right: i64,
+    top: i64,
+}
+
+impl Bbox {
+    fn contains(&self, lat: i64, lon: i64) -> bool {
+        self.bottom <= lat && lat <= self.top && self.left <= lon && lon <= self.right
+    }
+}
+
+impl FromStr for Bbox {
+    type Err = Error;
+
+    fn from_str(s: &str) -> Result<Self, Error> {
+        let coords: Vec<f64> = s
+            .split(',')
+            .map(|part| part.trim().parse())
+            .collect::<Result<_, _>>()?;
+        if coords.len() != 4 {
+            return Err("expected bbox as `left,bottom,right,top` in degrees".into());
+        }
+        let scale = |degrees: f64| (degrees * COORD_SCALE as f64).round() as i64;
+        let bbox = Self {
+            left: scale(coords[0]),
+            bottom: scale(coords[1]),
+            right: scale(coords[2]),
+            top: scale(coords[3]),
+        };
+        if bbox.left > bbox.right || bbox.bottom > bbox.top {
+            return Err("bbox is empty".into());
+        }
+        Ok(bbox)
+    }
+}
+
+/// Extractor of a bbox sub-archive from an osm.flatdata archive
+#[derive(Debug, StructOpt)]
+#[structopt(name = "osmflat-extract")]
+struct Args {
+    /// Verbose mode (-v, -vv, -vvv, etc.)
+    #[structopt(short, long, parse(from_occurrences))]
+    verbose: u8,
+
+    /// Input osmflat archive directory
+    #[structopt(name = "input", parse(from_os_str))]
+    input: PathBuf,
+
+    /// Output directory for the extracted archive
+    #[structopt(name = "output", parse(from_os_str))]
+    output: PathBuf,
+
+    /// Bounding box to extract as `left,bottom,right,top` in degrees
+    #[structopt(long = "bbox")]
+    bbox: Bbox,
+}
+
+/// Deduplicating in-memory string table.
+///
+/// Extracts are regional, so unlike the spilling table of the converter the
+/// interned strings comfortably fit in memory.
+#[derive(Debug, Default)]
+struct StringTable {
+    index: HashMap<Vec<u8>, u64>,
+    data: Vec<u8>,
+}
+
+impl StringTable {
+    fn insert(&mut self, s: &[u8]) -> u64 {
+        if let Some(&idx) = self.index.get(s) {
+            return idx;
+        }
+        let idx = self.data.len() as u64;
+        self.data.extend_from_slice(s);
+        self.data.push(b'\0');
+        self.index.insert(s.to_vec(), idx);
+        idx
+    }
+
+    fn next_index(&self) -> u64 {
+        self.data.len() as u64
+    }
+
+    fn into_bytes(self) -> Vec<u8> {
+        self.data
+    }
+}
+
+/// Holds tags external vector and deduplicates tags.
+struct TagSerializer<'a> {
+    tags: flatdata::ExternalVector<'a, osmflat::Tag>,
+    tags_index: flatdata::ExternalVector<'a, osmflat::TagIndex>,
+    dedup: HashMap<(u64, u64), u64>,
+}
+
+impl<'a> TagSerializer<'a> {
+    fn new(builder: &'a osmflat::OsmBuilder) -> io::Result<Self> {
+        Ok(Self {
+            tags: builder.start_tags()?,
+            tags_index: builder.start_tags_index()?,
+            dedup: HashMap::new(),
+        })
+    }
+
+    fn serialize(&mut self, key_idx: u64, val_idx: u64) -> Result<(), Error> {
+        let tags = &mut self.tags;
+        let idx = match self.dedup.entry((key_idx, val_idx)) {
+            std::collections::hash_map::Entry::Occupied(entry) => *entry.get(),
+            std::collections::hash_map::Entry::Vacant(entry) => {
+                let idx = tags.len() as u64;
+                let tag = tags.grow()?;
+                tag.set_key_idx(key_idx);
+                tag.set_value_idx(val_idx);
+                *entry.insert(idx)
+            }
+        };
+        self.tags_index.grow()?.set_value(idx);
+        Ok(())
+    }
+
+    fn next_index(&self) -> u64 {
+        self.tags_index.len() as u64
+    }
+
+    fn close(self) -> Result<(), Error> {
+        self.tags.close()?;
+        self.tags_index.close()?;
+        Ok(())
+    }
+}
+
+fn copy_tags(
+    archive: &Osm,
+    range: Range<u64>,
+    strings: &mut StringTable,
+    tags: &mut TagSerializer,
+) -> Result<(), Error> {
+    for (key, value) in osmflat::iter_tags(archive, range) {
+        let key_idx = strings.insert(key);
+        let val_idx = strings.insert(value);
+        tags.serialize(key_idx, val_idx)?;
+    }
+    Ok(())
+}
+
+/// Marks the entities to keep: nodes inside the bbox, ways touching a kept
+/// node plus all their nodes, and relations with at least one kept member
+/// (transitively for relation members).
+fn select(archive: &Osm, bbox: Bbox) -> (Vec<bool>, Vec<bool>, Vec<bool>) {
+    let nodes = archive.nodes();
+    let nodes_index = archive.nodes_index();
+
+    let mut keep_nodes: Vec<bool> = nodes
+        .iter()
+        .map(|node| bbox.contains(node.lat(), node.lon()))
+        .collect();
+
+    let mut keep_ways = vec![false; archive.ways().len()];
+    for (way_idx, way) in archive.ways().iter().enumerate() {
+        let node_of = |idx: u64| nodes_index[idx as usize].value();
+        if way
+            .refs()
+            .any(|idx| node_of(idx).map_or(false, |node_idx| keep_nodes[node_idx as usize]))
+        {
+            keep_ways[way_idx] = true;
+            // keep the way's remaining nodes so its geometry stays complete
+            for idx in way.refs() {
+                if let Some(node_idx) = node_of(idx) {
+                    keep_nodes[node_idx as usize] = true;
+                }
+            }
+        }
+    }
+
+    // relations can refer to relations, so iterate until no relation is added
+    let mut keep_relations = vec![false; archive.relations().len()];
+    loop {
+        let mut changed = false;
+        for relation_idx in 0..keep_relations.len() {
+            if keep_relations[relation_idx] {
+                continue;
+            }
+            let keep = archive
+                .relation_members()
+                .at(relation_idx)
+                .any(|member| match member {
+                    RelationMembersRef::NodeMember(m) => m
+                        .node_idx()
+                        .map_or(false, |idx| keep_nodes[idx as usize]),
+                    RelationMembersRef::WayMember(m) => {
+                        m.way_idx().map_or(false, |idx| keep_ways[idx as usize])
+                    }
+                    RelationMembersRef::RelationMember(m) => m
+                        .relation_idx()
+                        .map_or(false, |idx| keep_relations[idx as usize]),
+                });
+            if keep {
+                keep_relations[relation_idx] = true;
+                changed = true;
+            }
+        }
+        if !changed {
+            break;
+        }
+    }
+
+    (keep_nodes, keep_ways, keep_relations)
+}
+
+/// Maps kept source indices to their dense indices in the output archive.
+fn build_remap(keep: &[bool]) -> Vec<Option<u64>> {
+    let mut next = 0_u64;
+    keep.iter()
+        .map(|&keep| {
+            if keep {
+                next += 1;
+                Some(next - 1)
+            } else {
+                None
+            }
+        })
+        .collect()
+}
+
+fn copy_header(
+    archive: &Osm,
+    bbox: Bbox,
+    builder: &osmflat::OsmBuilder,
+    strings: &mut StringTable,
+) -> Result<(), Error> {
+    let src = archive.header();
+    let src_strings = archive.stringtable();
+    let mut header = osmflat::Header::new();
+
+    header.set_bbox_left(bbox.left);
+    header.set_bbox_right(bbox.right);
+    header.set_bbox_top(bbox.top);
+    header.set_bbox_bottom(bbox.bottom);
+
+    header.set_required_feature_first_idx(strings.next_index());
+    header.set_required_features_size(src.required_features_size());
+    let mut feature_idx = src.required_feature_first_idx() as usize;
+    for _ in 0..src.required_features_size() {
+        let feature = src_strings.substring_raw(feature_idx);
+        feature_idx += feature.len() + 1;
+        strings.insert(feature);
+    }
+
+    header.set_optional_feature_first_idx(strings.next_index());
+    header.set_optional_features_size(src.optional_features_size());
+    let mut feature_idx = src.optional_feature_first_idx() as usize;
+    for _ in 0..src.optional_features_size() {
+        let feature = src_strings.substring_raw(feature_idx);
+        feature_idx += feature.len() + 1;
+        strings.insert(feature);
+    }
+
+    header.set_writingprogram_idx(
+        strings.insert(src_strings.substring_raw(src.writingprogram_idx() as usize)),
+    );
+    header.set_source_idx(strings.insert(src_strings.substring_raw(src.source_idx() as usize)));
+    header.set_osmosis_replication_timestamp(src.osmosis_replication_timestamp());
+    header.set_osmosis_replication_sequence_number(src.osmosis_replication_sequence_number());
+    header.set_osmosis_replication_base_url_idx(
+        strings.insert(src_strings.substring_raw(src.osmosis_replication_base_url_idx() as usize)),
+    );
+
+    builder.set_header(&header)?;
+    Ok(())
+}
+
+fn run(args: Args) -> Result<(), Error> {
+    let archive = Osm::open(FileResourceStorage::new(args.input.clone()))?;
+    let builder = osmflat::OsmBuilder::new(FileResourceStorage::new(args.output.clone()))?;
+    let mut strings = StringTable::default();
+    let mut tags = TagSerializer::new(&builder)?;
+
+    info!("Selecting entities inside the bbox...");
+    let (keep_nodes, keep_ways, keep_relations) = select(&archive, args.bbox);
+    let node_remap = build_remap(&keep_nodes);
+    let way_remap = build_remap(&keep_ways);
+    let relation_remap = build_remap(&keep_relations);
+
+    copy_header(&archive, args.bbox, &builder, &mut strings)?;
+
+    let mut num_nodes = 0_usize;
+    let mut nodes = builder.start_nodes()?;
+    for (node, keep) in archive.nodes().iter().zip(&keep_nodes) {
+        if !keep {
+            continue;
+        }
+        let new_node = nodes.grow()?;
+        new_node.set_id(node.id());
+        new_node.set_lat(node.lat());
+        new_node.set_lon(node.lon());
+        new_node.set_tag_first_idx(tags.next_index());
+        copy_tags(&archive, node.tags(), &mut strings, &mut tags)?;
+        num_nodes += 1;
+    }
+    nodes.grow()?.set_tag_first_idx(tags.next_index());
+    nodes.close()?;
+    info!("Extracted {} nodes.", num_nodes);
+
+    let mut num_ways = 0_usize;
+    let mut ways = builder.start_ways()?;
+    let mut nodes_index = builder.start_nodes_index()?;
+    let src_nodes_index = archive.nodes_index();
+    for (way, keep) in archive.ways().iter().zip(&keep_ways) {
+        if !keep {
+            continue;
+        }
+        let new_way = ways.grow()?;
+        new_way.set_id(way.id());
+        new_way.set_tag_first_idx(tags.next_index());
+        copy_tags(&archive, way.tags(), &mut strings, &mut tags)?;
+        new_way.set_ref_first_idx(nodes_index.len() as u64);
+        for idx in way.refs() {
+            let idx = src_nodes_index[idx as usize]
+                .value()
+                .and_then(|node_idx| node_remap[node_idx as usize]);
+            nodes_index.grow()?.set_value(idx);
+        }
+        num_ways += 1;
+    }
+    {
+        let sentinel = ways.grow()?;
+        sentinel.set_tag_first_idx(tags.next_index());
+        sentinel.set_ref_first_idx(nodes_index.len() as u64);
+    }
+    ways.close()?;
+    nodes_index.close()?;
+    info!("Extracted {} ways.", num_ways);
+
+    let mut num_relations = 0_usize;
+    let mut relations = builder.start_relations()?;
+    let mut relation_members = builder.start_relation_members()?;
+    let src_strings = archive.stringtable();
+    for (relation_idx, (relation, keep)) in
+        archive.relations().iter().zip(&keep_relations).enumerate()
+    {
+        if !keep {
+            continue;
+        }
+        let new_relation = relations.grow()?;
+        new_relation.set_id(relation.id());
+        new_relation.set_tag_first_idx(tags.next_index());
+        copy_tags(&archive, relation.tags(), &mut strings, &mut tags)?;
+
+        let mut members = relation_members.grow()?;
+        for member in archive.relation_members().at(relation_idx) {
+            match member {
+                RelationMembersRef::NodeMember(m) => {
+                    let new_member = members.add_node_member();
+                    new_member.set_node_idx(
+                        m.node_idx().and_then(|idx| node_remap[idx as usize]),
+                    );
+                    new_member.set_role_idx(
+                        strings.insert(src_strings.substring_raw(m.role_idx() as usize)),
+                    );
+                }
+                RelationMembersRef::WayMember(m) => {
+                    let new_member = members.add_way_member();
+                    new_member
+                        .set_way_idx(m.way_idx().and_then(|idx| way_remap[idx as usize]));
+                    new_member.set_role_idx(
+                        strings.insert(src_strings.substring_raw(m.role_idx() as usize)),
+                    );
+                }
+                RelationMembersRef::RelationMember(m) => {
+                    let new_member = members.add_relation_member();
+                    new_member.set_relation_idx(
+                        m.relation_idx().and_then(|idx| relation_remap[idx as usize]),
+                    );
+                    new_member.set_role_idx(
+                        strings.insert(src_strings.substring_raw(m.role_idx() as usize)),
+                    );
+                }
+            }
+        }
+        num_relations += 1;
+    }
+    {
+        let sentinel = relations.grow()?;
+        sentinel.set_tag_first_idx(tags.next_index());
+    }
+    relations.close()?;
+    relation_members.close()?;
+    info!("Extracted {} relations.", num_relations);
+
+    tags.close()?;
+    builder.set_stringtable(&strings.into_bytes())?;
+
+    info!("Extract written to: {}", args.output.display());
+    Ok(())
+}
+
+fn main() {
+    let args = Args::from_args();
+    let level = match args.verbose {
+        0 => "info",
+        1 => "debug",
+        _ => "trace",
+    };
+    env_logger::Builder::from_env(env_logger::Env::default().default_filter_or(level))
+        .format_module_path(false)
+        .format_timestamp_nanos()
+        .init();
+
+    if let Err(e) = run(args) {
+        eprintln!("{}: {}", "Error".red(), e);
+        std::process::exit(1);
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    #[test]
+    fn test_bbox_from_str() {
+        let bbox: Bbox = "13.0,52.3, 13.8,52.7".parse().unwrap();
+        assert_eq!(bbox.left, 13_000_000_000);
+        assert_eq!(bbox.bottom, 52_300_000_000);
+        assert_eq!(bbox.right, 13_800_000_000);
+        assert_eq!(bbox.top, 52_700_000_000);
+        assert!(bbox.contains(52_500_000_000, 13_400_000_000));
+        assert!(!bbox.contains(52_500_000_000, 14_000_000_000));
+
+        assert!("13.0,52.3,13.8".parse::<Bbox>().is_err());
+        assert!("13.8,52.3,13.0,52.7".parse::<Bbox>().is_err());
+    }
+
+    #[test]
+    fn test_build_remap() {
+        let remap = build_remap(&[true, false, true, true, false]);
+        assert_eq!(remap, vec![Some(0), None, Some(1), Some(2), None]);
+    }
+}
@@ -0,0 +1,419 @@
+//! Merges multiple osmflat archives into one.
+//!
+//! Entity vectors are concatenated input by input; entities appearing in
+//! several inputs (duplicated along extract borders) are deduplicated by
+//! their OSM id, with the first input winning. All `tag_first_idx` and
+//! `ref_first_idx` ranges are rebuilt for the merged resources, the
+//! stringtables are deduplicated into one, and cross-archive references are
+//! re-resolved through the merged id maps, so a way of one input can point
+//! at the canonical copy of a node that another input contributed.
+
+use colored::Colorize;
+use flatdata::FileResourceStorage;
+use log::info;
+use osmflat::{Osm, RelationMembersRef};
+use structopt::StructOpt;
+
+use std::collections::HashMap;
+use std::io;
+use std::ops::Range;
+use std::path::PathBuf;
+
+type Error = Box<dyn std::error::Error>;
+
+/// Merger of multiple osm.flatdata archives into one
+#[derive(Debug, StructOpt)]
+#[structopt(name = "osmflat-merge")]
+struct Args {
+    /// Verbose mode (-v, -vv, -vvv, etc.)
+    #[structopt(short, long, parse(from_occurrences))]
+    verbose: u8,
+
+    /// Input osmflat archive directories (merged in order; on duplicate ids
+    /// the first input wins)
+    #[structopt(name = "input", parse(from_os_str), required = true)]
+    inputs: Vec<PathBuf>,
+
+    /// Output directory for the merged archive
+    #[structopt(name = "output", long = "output", short = "o", parse(from_os_str))]
+    output: PathBuf,
+}
+
+/// Deduplicating in-memory string table.
+///
+/// The input stringtables are already deduplicated per archive, so the
+/// merged set of distinct strings stays far below the merged entity count.
+#[derive(Debug, Default)]
+struct StringTable {
+    index: HashMap<Vec<u8>, u64>,
+    data: Vec<u8>,
+}
+
+impl StringTable {
+    fn insert(&mut self, s: &[u8]) -> u64 {
+        if let Some(&idx) = self.index.get(s) {
+            return idx;
+        }
+        let idx = self.data.len() as u64;
+        self.data.extend_from_slice(s);
+        self.data.push(b'\0');
+        self.index.insert(s.to_vec(), idx);
+        idx
+    }
+
+    fn next_index(&self) -> u64 {
+        self.data.len() as u64
+    }
+
+    fn into_bytes(self) -> Vec<u8> {
+        self.data
+    }
+}
+
+/// Holds tags external vector and deduplicates tags.
+struct TagSerializer<'a> {
+    tags: flatdata::ExternalVector<'a, osmflat::Tag>,
+    tags_index: flatdata::ExternalVector<'a, osmflat::TagIndex>,
+    dedup: HashMap<(u64, u64), u64>,
+}
+
+impl<'a> TagSerializer<'a> {
+    fn new(builder: &'a osmflat::OsmBuilder) -> io::Result<Self> {
+        Ok(Self {
+            tags: builder.start_tags()?,
+            tags_index: builder.start_tags_index()?,
+            dedup: HashMap::new(),
+        })
+    }
+
+    fn serialize(&mut self, key_idx: u64, val_idx: u64) -> Result<(), Error> {
+        let tags = &mut self.tags;
+        let idx = match self.dedup.entry((key_idx, val_idx)) {
+            std::collections::hash_map::Entry::Occupied(entry) => *entry.get(),
+            std::collections::hash_map::Entry::Vacant(entry) => {
+                let idx = tags.len() as u64;
+                let tag = tags.grow()?;
+                tag.set_key_idx(key_idx);
+                tag.set_value_idx(val_idx);
+                *entry.insert(idx)
+            }
+        };
+        self.tags_index.grow()?.set_value(idx);
+        Ok(())
+    }
+
+    fn next_index(&self) -> u64 {
+        self.tags_index.len() as u64
+    }
+
+    fn close(self) -> Result<(), Error> {
+        self.tags.close()?;
+        self.tags_index.close()?;
+        Ok(())
+    }
+}
+
+fn copy_tags(
+    archive: &Osm,
+    range: Range<u64>,
+    strings: &mut StringTable,
+    tags: &mut TagSerializer,
+) -> Result<(), Error> {
+    for (key, value) in osmflat::iter_tags(archive, range) {
+        let key_idx = strings.insert(key);
+        let val_idx = strings.insert(value);
+        tags.serialize(key_idx, val_idx)?;
+    }
+    Ok(())
+}
+
+/// Per-input mapping from source entity indices to merged indices.
+///
+/// Duplicates map to the canonical copy contributed by an earlier input, so
+/// references always resolve to the entity that was actually emitted.
+struct Remap {
+    by_input: Vec<Vec<u64>>,
+}
+
+impl Remap {
+    /// Builds the merged id map for one entity type by scanning the ids of
+    /// all inputs in order. Returns the remap tables and, per input, which
+    /// entities are emitted (i.e. seen for the first time).
+    fn build<'a>(
+        ids_of_input: impl Iterator<Item = Box<dyn Iterator<Item = i64> + 'a>>,
+    ) -> (Self, Vec<Vec<bool>>) {
+        let mut id_to_idx: HashMap<i64, u64> = HashMap::new();
+        let mut next = 0_u64;
+        let mut by_input = Vec::new();
+        let mut emitted = Vec::new();
+        for ids in ids_of_input {
+            let mut remap = Vec::new();
+            let mut emit = Vec::new();
+            for id in ids {
+                match id_to_idx.entry(id) {
+                    std::collections::hash_map::Entry::Occupied(entry) => {
+                        remap.push(*entry.get());
+                        emit.push(false);
+                    }
+                    std::collections::hash_map::Entry::Vacant(entry) => {
+                        remap.push(*entry.insert(next));
+                        emit.push(true);
+                        next += 1;
+                    }
+                }
+            }
+            by_input.push(remap);
+            emitted.push(emit);
+        }
+        (Self { by_input }, emitted)
+    }
+
+    fn get(&self, input: usize, idx: u64) -> u64 {
+        self.by_input[input][idx as usize]
+    }
+}
+
+fn merge_headers(
+    archives: &[Osm],
+    builder: &osmflat::OsmBuilder,
+    strings: &mut StringTable,
+) -> Result<(), Error> {
+    let first = archives[0].header();
+    let first_strings = archives[0].stringtable();
+    let mut header = osmflat::Header::new();
+
+    // union of the input bboxes
+    header.set_bbox_left(archives.iter().map(|a| a.header().bbox_left()).min().unwrap());
+    header.set_bbox_right(archives.iter().map(|a| a.header().bbox_right()).max().unwrap());
+    header.set_bbox_bottom(
+        archives.iter().map(|a| a.header().bbox_bottom()).min().unwrap(),
+    );
+    header.set_bbox_top(archives.iter().map(|a| a.header().bbox_top()).max().unwrap());
+
+    // the remaining metadata is taken from the first input
+    header.set_required_feature_first_idx(strings.next_index());
+    header.set_required_features_size(first.required_features_size());
+    let mut feature_idx = first.required_feature_first_idx() as usize;
+    for _ in 0..first.required_features_size() {
+        let feature = first_strings.substring_raw(feature_idx);
+        feature_idx += feature.len() + 1;
+        strings.insert(feature);
+    }
+
+    header.set_optional_feature_first_idx(strings.next_index());
+    header.set_optional_features_size(first.optional_features_size());
+    let mut feature_idx = first.optional_feature_first_idx() as usize;
+    for _ in 0..first.optional_features_size() {
+        let feature = first_strings.substring_raw(feature_idx);
+        feature_idx += feature.len() + 1;
+        strings.insert(feature);
+    }
+
+    header.set_writingprogram_idx(
+        strings.insert(first_strings.substring_raw(first.writingprogram_idx() as usize)),
+    );
+    header
+        .set_source_idx(strings.insert(first_strings.substring_raw(first.source_idx() as usize)));
+    // replication state is per input and not meaningful for the union
+    header.set_osmosis_replication_timestamp(
+        archives
+            .iter()
+            .map(|a| a.header().osmosis_replication_timestamp())
+            .min()
+            .unwrap(),
+    );
+    header.set_osmosis_replication_base_url_idx(strings.insert(b""));
+
+    builder.set_header(&header)?;
+    Ok(())
+}
+
+fn run(args: Args) -> Result<(), Error> {
+    let archives: Vec<Osm> = args
+        .inputs
+        .iter()
+        .map(|input| Osm::open(FileResourceStorage::new(input.clone())))
+        .collect::<Result<_, _>>()?;
+    if archives.is_empty() {
+        return Err("at least one input archive is required".into());
+    }
+    let builder = osmflat::OsmBuilder::new(FileResourceStorage::new(args.output.clone()))?;
+    let mut strings = StringTable::default();
+    let mut tags = TagSerializer::new(&builder)?;
+
+    merge_headers(&archives, &builder, &mut strings)?;
+
+    info!("Merging nodes of {} archives...", archives.len());
+    let (node_remap, emit_nodes) = Remap::build(
+        archives
+            .iter()
+            .map(|a| Box::new(a.nodes().iter().map(|node| node.id())) as Box<_>),
+    );
+    let mut nodes = builder.start_nodes()?;
+    for (archive, emit) in archives.iter().zip(&emit_nodes) {
+        for (node, emit) in archive.nodes().iter().zip(emit) {
+            if !emit {
+                continue;
+            }
+            let new_node = nodes.grow()?;
+            new_node.set_id(node.id());
+            new_node.set_lat(node.lat());
+            new_node.set_lon(node.lon());
+            new_node.set_tag_first_idx(tags.next_index());
+            copy_tags(archive, node.tags(), &mut strings, &mut tags)?;
+        }
+    }
+    nodes.grow()?.set_tag_first_idx(tags.next_index());
+    nodes.close()?;
+
+    info!("Merging ways...");
+    let (way_remap, emit_ways) = Remap::build(
+        archives
+            .iter()
+            .map(|a| Box::new(a.ways().iter().map(|way| way.id())) as Box<_>),
+    );
+    let mut ways = builder.start_ways()?;
+    let mut nodes_index = builder.start_nodes_index()?;
+    for (input, (archive, emit)) in archives.iter().zip(&emit_ways).enumerate() {
+        let src_nodes_index = archive.nodes_index();
+        for (way, emit) in archive.ways().iter().zip(emit) {
+            if !emit {
+                continue;
+            }
+            let new_way = ways.grow()?;
+            new_way.set_id(way.id());
+            new_way.set_tag_first_idx(tags.next_index());
+            copy_tags(archive, way.tags(), &mut strings, &mut tags)?;
+            new_way.set_ref_first_idx(nodes_index.len() as u64);
+            for idx in way.refs() {
+                let idx = src_nodes_index[idx as usize]
+                    .value()
+                    .map(|node_idx| node_remap.get(input, node_idx));
+                nodes_index.grow()?.set_value(idx);
+            }
+        }
+    }
+    {
+        let sentinel = ways.grow()?;
+        sentinel.set_tag_first_idx(tags.next_index());
+        sentinel.set_ref_first_idx(nodes_index.len() as u64);
+    }
+    ways.close()?;
+    nodes_index.close()?;
+
+    info!("Merging relations...");
+    let (relation_remap, emit_relations) = Remap::build(
+        archives
+            .iter()
+            .map(|a| Box::new(a.relations().iter().map(|relation| relation.id())) as Box<_>),
+    );
+    let mut relations = builder.start_relations()?;
+    let mut relation_members = builder.start_relation_members()?;
+    for (input, (archive, emit)) in archives.iter().zip(&emit_relations).enumerate() {
+        let src_strings = archive.stringtable();
+        for (relation_idx, (relation, emit)) in
+            archive.relations().iter().zip(emit).enumerate()
+        {
+            if !emit {
+                continue;
+            }
+            let new_relation = relations.grow()?;
+            new_relation.set_id(relation.id());
+            new_relation.set_tag_first_idx(tags.next_index());
+            copy_tags(archive, relation.tags(), &mut strings, &mut tags)?;
+
+            let mut members = relation_members.grow()?;
+            for member in archive.relation_members().at(relation_idx) {
+                match member {
+                    RelationMembersRef::NodeMember(m) => {
+                        let new_member = members.add_node_member();
+                        new_member.set_node_idx(
+                            m.node_idx().map(|idx| node_remap.get(input, idx)),
+                        );
+                        new_member.set_role_idx(
+                            strings.insert(src_strings.substring_raw(m.role_idx() as usize)),
+                        );
+                    }
+                    RelationMembersRef::WayMember(m) => {
+                        let new_member = members.add_way_member();
+                        new_member
+                            .set_way_idx(m.way_idx().map(|idx| way_remap.get(input, idx)));
+                        new_member.set_role_idx(
+                            strings.insert(src_strings.substring_raw(m.role_idx() as usize)),
+                        );
+                    }
+                    RelationMembersRef::RelationMember(m) => {
+                        let new_member = members.add_relation_member();
+                        new_member.set_relation_idx(
+                            m.relation_idx().map(|idx| relation_remap.get(input, idx)),
+                        );
+                        new_member.set_role_idx(
+                            strings.insert(src_strings.substring_raw(m.role_idx() as usize)),
+                        );
+                    }
+                }
+            }
+        }
+    }
+    {
+        let sentinel = relations.grow()?;
+        sentinel.set_tag_first_idx(tags.next_index());
+    }
+    relations.close()?;
+    relation_members.close()?;
+
+    tags.close()?;
+    builder.set_stringtable(&strings.into_bytes())?;
+
+    info!("Merged archive written to: {}", args.output.display());
+    Ok(())
+}
+
+fn main() {
+    let args = Args::from_args();
+    let level = match args.verbose {
+        0 => "info",
+        1 => "debug",
+        _ => "trace",
+    };
+    env_logger::Builder::from_env(env_logger::Env::default().default_filter_or(level))
+        .format_module_path(false)
+        .format_timestamp_nanos()
+        .init();
+
+    if let Err(e) = run(args) {
+        eprintln!("{}: {}", "Error".red(), e);
+        std::process::exit(1);
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    #[test]
+    fn test_remap_deduplicates_by_id() {
+        let inputs: Vec<Vec<i64>> = vec![vec![1, 2, 3], vec![3, 4, 1], vec![5]];
+        let (remap, emitted) = Remap::build(
+            inputs
+                .iter()
+                .map(|ids| Box::new(ids.iter().cloned()) as Box<_>),
+        );
+
+        assert_eq!(emitted[0], vec![true, true, true]);
+        // 3 and 1 are duplicates of input 0
+        assert_eq!(emitted[1], vec![false, true, false]);
+        assert_eq!(emitted[2], vec![true]);
+
+        // duplicates resolve to the canonical copy
+        assert_eq!(remap.get(1, 0), remap.get(0, 2));
+        assert_eq!(remap.get(1, 2), remap.get(0, 0));
+        // merged indices are dense in emission order
+        assert_eq!(
+            (0..3).map(|i| remap.get(0, i)).collect::<Vec<_>>(),
+            vec![0, 1, 2]
+        );
+        assert_eq!(remap.get(1, 1), 3);
+        assert_eq!(remap.get(2, 0), 4);
+    }
+}
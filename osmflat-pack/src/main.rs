@@ -0,0 +1,104 @@
+//! Packs an osmflat archive directory into a single block-compressed
+//! container file, and unpacks such files back into plain archives.
+//!
+//! Packed archives trade decode CPU for several-fold smaller disk usage
+//! and can still be opened through the regular `Osm` API via
+//! `osmflat::pack::PackedStorage`. See the `osmflat::pack` module for the
+//! container format.
+
+use colored::Colorize;
+use log::info;
+use structopt::StructOpt;
+
+use std::fs;
+use std::io;
+use std::path::{Path, PathBuf};
+
+/// Packer of osm.flatdata archives into block-compressed container files
+#[derive(Debug, StructOpt)]
+#[structopt(name = "osmflat-pack")]
+struct Args {
+    /// Verbose mode (-v, -vv, -vvv, etc.)
+    #[structopt(short, long, parse(from_occurrences))]
+    verbose: u8,
+
+    #[structopt(subcommand)]
+    cmd: Command,
+}
+
+#[derive(Debug, StructOpt)]
+enum Command {
+    /// Packs an archive directory into a container file
+    #[structopt(name = "pack")]
+    Pack {
+        /// Input osmflat archive directory
+        #[structopt(name = "archive", parse(from_os_str))]
+        archive: PathBuf,
+
+        /// Output container file
+        #[structopt(name = "output", parse(from_os_str))]
+        output: PathBuf,
+    },
+    /// Unpacks a container file back into an archive directory
+    #[structopt(name = "unpack")]
+    Unpack {
+        /// Input container file
+        #[structopt(name = "archive", parse(from_os_str))]
+        archive: PathBuf,
+
+        /// Output directory for the plain archive
+        #[structopt(name = "output", parse(from_os_str))]
+        output: PathBuf,
+    },
+}
+
+fn dir_size(dir: &Path) -> io::Result<u64> {
+    let mut size = 0;
+    for entry in fs::read_dir(dir)? {
+        let entry = entry?;
+        if entry.file_type()?.is_file() {
+            size += entry.metadata()?.len();
+        }
+    }
+    Ok(size)
+}
+
+fn run(args: Args) -> io::Result<()> {
+    match args.cmd {
+        Command::Pack { archive, output } => {
+            osmflat::pack::pack_archive(&archive, &output)?;
+            let raw = dir_size(&archive)?;
+            let packed = fs::metadata(&output)?.len();
+            info!(
+                "Packed archive written to: {} ({} -> {} bytes, {:.1}x)",
+                output.display(),
+                raw,
+                packed,
+                raw as f64 / packed.max(1) as f64
+            );
+        }
+        Command::Unpack { archive, output } => {
+            osmflat::pack::unpack_archive(&archive, &output)?;
+            info!("Unpacked archive written to: {}", output.display());
+        }
+    }
+    Ok(())
+}
+
+fn main() {
+    let args = Args::from_args();
+    let level = match args.verbose {
+        0 => "info",
+        1 => "debug",
+        _ => "trace",
+    };
+    env_logger::Builder::from_env(env_logger::Env::default().default_filter_or(level))
+        .format_module_path(false)
+        .format_timestamp_nanos()
+        .init();
+
+    if let Err(e) = run(args) {
+        eprintln!("{}: {}", "Error".red(), e);
+        std::process::exit(1);
+    }
+}
@@ -0,0 +1,467 @@
+//! Verifies the structural integrity of an osmflat archive.
+//!
+//! Checks that every `tag_first_idx`/`ref_first_idx` range is monotonic and
+//! in-bounds, that every `nodes_index`/`tags_index` entry resolves, that
+//! every stringtable reference points at a `\0`-terminated string, and that
+//! the sentinel convention holds. The entity checks run in parallel chunks
+//! over the mmap'd resources, so a healthy archive is verified at roughly
+//! memory bandwidth — fast enough for a post-deploy gate after shipping an
+//! archive to another machine.
+
+use colored::Colorize;
+use flatdata::FileResourceStorage;
+use log::info;
+use osmflat::{parallel, Osm, RelationMembersRef};
+use rayon::prelude::*;
+use structopt::StructOpt;
+
+use std::path::PathBuf;
+use std::time::Instant;
+
+type Error = Box<dyn std::error::Error>;
+
+/// Maximal number of violations reported per check; counting continues.
+const MAX_REPORTED: usize = 20;
+
+/// Verifier of the structural integrity of an osm.flatdata archive
+#[derive(Debug, StructOpt)]
+#[structopt(name = "osmflat-verify")]
+struct Args {
+    /// Verbose mode (-v, -vv, -vvv, etc.)
+    #[structopt(short, long, parse(from_occurrences))]
+    verbose: u8,
+
+    /// osmflat archive directory to verify
+    #[structopt(name = "archive", parse(from_os_str))]
+    archive: PathBuf,
+}
+
+/// The stringtable must end with `\0`, so that every reference below its
+/// size hits a terminated string. All other checks rely on this.
+fn check_stringtable(archive: &Osm) -> Vec<String> {
+    let strings = archive.stringtable().as_bytes();
+    match strings.last() {
+        Some(&b'\0') | None => Vec::new(),
+        Some(_) => vec!["stringtable does not end with \\0".into()],
+    }
+}
+
+fn check_header(archive: &Osm) -> Vec<String> {
+    let header = archive.header();
+    let strings = archive.stringtable().as_bytes();
+    let mut errors = Vec::new();
+
+    let mut check_idx = |what: &str, idx: u64| {
+        if idx >= strings.len() as u64 {
+            errors.push(format!("header: {} {} exceeds stringtable", what, idx));
+        }
+    };
+    check_idx("writingprogram_idx", header.writingprogram_idx());
+    check_idx("source_idx", header.source_idx());
+    check_idx(
+        "osmosis_replication_base_url_idx",
+        header.osmosis_replication_base_url_idx(),
+    );
+
+    let mut check_features = |what: &str, first_idx: u64, size: u32| {
+        let mut idx = first_idx as usize;
+        for _ in 0..size {
+            if idx >= strings.len() {
+                errors.push(format!("header: {} walk exceeds stringtable", what));
+                return;
+            }
+            idx += archive.stringtable().substring_raw(idx).len() + 1;
+        }
+    };
+    check_features(
+        "required_features",
+        header.required_feature_first_idx(),
+        header.required_features_size(),
+    );
+    check_features(
+        "optional_features",
+        header.optional_feature_first_idx(),
+        header.optional_features_size(),
+    );
+    errors
+}
+
+/// Every node's tag range is monotonic and inside `tags_index`. The range
+/// accessor reads the next node resp. the sentinel, so checking every range
+/// also verifies that the `tag_first_idx` sequence including the sentinel is
+/// non-decreasing.
+fn check_nodes(archive: &Osm) -> Vec<String> {
+    let num_tags_index = archive.tags_index().len() as u64;
+    parallel::par_nodes(archive)
+        .enumerate()
+        .filter_map(|(idx, node)| {
+            let tags = node.tags();
+            if tags.start > tags.end || tags.end > num_tags_index {
+                Some(format!("node {}: invalid tag range {:?}", idx, tags))
+            } else {
+                None
+            }
+        })
+        .collect()
+}
+
+fn check_ways(archive: &Osm) -> Vec<String> {
+    let num_tags_index = archive.tags_index().len() as u64;
+    let num_nodes_index = archive.nodes_index().len() as u64;
+    parallel::par_ways(archive)
+        .enumerate()
+        .flat_map(|(idx, way)| {
+            let mut errors = Vec::new();
+            let tags = way.tags();
+            if tags.start > tags.end || tags.end > num_tags_index {
+                errors.push(format!("way {}: invalid tag range {:?}", idx, tags));
+            }
+            let refs = way.refs();
+            if refs.start > refs.end || refs.end > num_nodes_index {
+                errors.push(format!("way {}: invalid ref range {:?}", idx, refs));
+            }
+            errors
+        })
+        .collect()
+}
+
+fn check_relations(archive: &Osm) -> Vec<String> {
+    let num_tags_index = archive.tags_index().len() as u64;
+    let num_nodes = archive.nodes().len() as u64;
+    let num_ways = archive.ways().len() as u64;
+    let num_relations = archive.relations().len() as u64;
+    let num_strings = archive.stringtable().as_bytes().len() as u64;
+    let relation_members = archive.relation_members();
+
+    parallel::par_relations(archive)
+        .flat_map(|(idx, relation)| {
+            let mut errors = Vec::new();
+            let tags = relation.tags();
+            if tags.start > tags.end || tags.end > num_tags_index {
+                errors.push(format!("relation {}: invalid tag range {:?}", idx, tags));
+            }
+            for member in relation_members.at(idx) {
+                let (entity_idx, num_entities, role_idx) = match member {
+                    RelationMembersRef::NodeMember(m) => {
+                        (m.node_idx(), num_nodes, m.role_idx())
+                    }
+                    RelationMembersRef::WayMember(m) => (m.way_idx(), num_ways, m.role_idx()),
+                    RelationMembersRef::RelationMember(m) => {
+                        (m.relation_idx(), num_relations, m.role_idx())
+                    }
+                };
+                if entity_idx.map_or(false, |entity_idx| entity_idx >= num_entities) {
+                    errors.push(format!("relation {}: unresolvable member", idx));
+                }
+                if role_idx >= num_strings {
+                    errors.push(format!("relation {}: role exceeds stringtable", idx));
+                }
+            }
+            errors
+        })
+        .collect()
+}
+
+/// Every tag references strings inside the stringtable.
+fn check_tags(archive: &Osm) -> Vec<String> {
+    let num_strings = archive.stringtable().as_bytes().len() as u64;
+    archive
+        .tags()
+        .par_iter()
+        .enumerate()
+        .filter_map(|(idx, tag)| {
+            if tag.key_idx() >= num_strings || tag.value_idx() >= num_strings {
+                Some(format!("tag {}: string index exceeds stringtable", idx))
+            } else {
+                None
+            }
+        })
+        .collect()
+}
+
+/// Every `tags_index` entry resolves to a tag.
+fn check_tags_index(archive: &Osm) -> Vec<String> {
+    let num_tags = archive.tags().len() as u64;
+    archive
+        .tags_index()
+        .par_iter()
+        .enumerate()
+        .filter_map(|(idx, entry)| {
+            if entry.value() >= num_tags {
+                Some(format!("tags_index {}: unresolvable tag {}", idx, entry.value()))
+            } else {
+                None
+            }
+        })
+        .collect()
+}
+
+/// Every resolved `nodes_index` entry points at a node.
+fn check_nodes_index(archive: &Osm) -> Vec<String> {
+    let num_nodes = archive.nodes().len() as u64;
+    archive
+        .nodes_index()
+        .par_iter()
+        .enumerate()
+        .filter_map(|(idx, entry)| {
+            if entry.value().map_or(false, |node_idx| node_idx >= num_nodes) {
+                Some(format!("nodes_index {}: unresolvable node", idx))
+            } else {
+                None
+            }
+        })
+        .collect()
+}
+
+/// The ways sentinel closes the last ref range exactly at the end of
+/// `nodes_index`, i.e. no entry of the resource is dangling.
+fn check_sentinels(archive: &Osm) -> Vec<String> {
+    let mut errors = Vec::new();
+    if let Some(way) = archive.ways().last() {
+        let end = way.refs().end;
+        if end != archive.nodes_index().len() as u64 {
+            errors.push(format!(
+                "ways sentinel: ref_first_idx {} does not close nodes_index of size {}",
+                end,
+                archive.nodes_index().len()
+            ));
+        }
+    }
+    errors
+}
+
+fn checks() -> [(&'static str, fn(&Osm) -> Vec<String>); 9] {
+    [
+        ("stringtable", check_stringtable),
+        ("header", check_header),
+        ("nodes", check_nodes),
+        ("ways", check_ways),
+        ("relations", check_relations),
+        ("tags", check_tags),
+        ("tags_index", check_tags_index),
+        ("nodes_index", check_nodes_index),
+        ("sentinels", check_sentinels),
+    ]
+}
+
+fn run(args: Args) -> Result<(), Error> {
+    let archive = Osm::open(FileResourceStorage::new(args.archive.clone()))?;
+
+    let mut num_errors = 0_usize;
+    for (name, check) in &checks() {
+        let start = Instant::now();
+        let errors = check(&archive);
+        if errors.is_empty() {
+            info!("{:<12} ok ({:?})", name, start.elapsed());
+        } else {
+            num_errors += errors.len();
+            info!(
+                "{:<12} {} violations ({:?})",
+                name,
+                errors.len(),
+                start.elapsed()
+            );
+            for error in errors.iter().take(MAX_REPORTED) {
+                eprintln!("{}", error);
+            }
+            if errors.len() > MAX_REPORTED {
+                eprintln!("... and {} more", errors.len() - MAX_REPORTED);
+            }
+        }
+        // all string reference checks are meaningless without the terminator
+        if num_errors > 0 && *name == "stringtable" {
+            break;
+        }
+    }
+
+    if num_errors > 0 {
+        return Err(format!("archive is corrupt: {} violations", num_errors).into());
+    }
+    info!("Archive is structurally sound: {}", args.archive.display());
+    Ok(())
+}
+
+fn main() {
+    let args = Args::from_args();
+    let level = match args.verbose {
+        0 => "info",
+        1 => "debug",
+        _ => "trace",
+    };
+    env_logger::Builder::from_env(env_logger::Env::default().default_filter_or(level))
+        .format_module_path(false)
+        .format_timestamp_nanos()
+        .init();
+
+    if let Err(e) = run(args) {
+        eprintln!("{}: {}", "Error".red(), e);
+        std::process::exit(1);
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+    use flatdata::MemoryResourceStorage;
+
+    /// One structural defect per check of the verifier.
+    #[derive(Debug, Clone, Copy, PartialEq)]
+    enum Corrupt {
+        Nothing,
+        Stringtable,
+        Header,
+        Nodes,
+        Ways,
+        Relations,
+        Tags,
+        TagsIndex,
+        NodesIndex,
+        Sentinels,
+    }
+
+    /// Builds a small in-memory archive: two tagged nodes, one way over
+    /// both, one relation with a way member — with at most one defect.
+    fn build_archive(corrupt: Corrupt) -> Osm {
+        let storage = MemoryResourceStorage::new("/verify-test");
+        {
+            let builder = osmflat::OsmBuilder::new(storage.clone()).unwrap();
+            let mut strings = vec![0_u8]; // empty string at offset 0
+            let mut string_idx = |s: &str| {
+                let idx = strings.len() as u64;
+                strings.extend_from_slice(s.as_bytes());
+                strings.push(b'\0');
+                idx
+            };
+
+            let mut tags = builder.start_tags().unwrap();
+            let mut tags_index = builder.start_tags_index().unwrap();
+            for i in 0..2_u64 {
+                let tag = tags.grow().unwrap();
+                tag.set_key_idx(if corrupt == Corrupt::Tags && i == 0 {
+                    10_000 // beyond the stringtable
+                } else {
+                    string_idx(&format!("key_{}", i))
+                });
+                tag.set_value_idx(string_idx(&format!("value_{}", i)));
+                let entry = tags_index.grow().unwrap();
+                entry.set_value(if corrupt == Corrupt::TagsIndex && i == 0 {
+                    99 // no such tag
+                } else {
+                    i
+                });
+            }
+            tags.close().unwrap();
+            tags_index.close().unwrap();
+
+            let mut nodes = builder.start_nodes().unwrap();
+            for i in 0..2_i64 {
+                let node = nodes.grow().unwrap();
+                node.set_id(i);
+                node.set_tag_first_idx(if corrupt == Corrupt::Nodes && i == 1 {
+                    5 // makes the first range overlong and the second inverted
+                } else {
+                    i as u64
+                });
+            }
+            nodes.grow().unwrap().set_tag_first_idx(2);
+            nodes.close().unwrap();
+
+            let mut nodes_index = builder.start_nodes_index().unwrap();
+            for i in 0..2_u64 {
+                let entry = nodes_index.grow().unwrap();
+                entry.set_value(if corrupt == Corrupt::NodesIndex && i == 0 {
+                    Some(99) // no such node
+                } else {
+                    Some(i)
+                });
+            }
+            nodes_index.close().unwrap();
+
+            let mut ways = builder.start_ways().unwrap();
+            let way = ways.grow().unwrap();
+            way.set_id(0);
+            way.set_tag_first_idx(2);
+            way.set_ref_first_idx(if corrupt == Corrupt::Ways {
+                100 // inverted and out-of-bounds ref range
+            } else {
+                0
+            });
+            let sentinel = ways.grow().unwrap();
+            sentinel.set_tag_first_idx(2);
+            sentinel.set_ref_first_idx(if corrupt == Corrupt::Sentinels {
+                1 // leaves the last nodes_index entry dangling
+            } else {
+                2
+            });
+            ways.close().unwrap();
+
+            let mut relations = builder.start_relations().unwrap();
+            let relation = relations.grow().unwrap();
+            relation.set_id(0);
+            relation.set_tag_first_idx(2);
+            relations.grow().unwrap().set_tag_first_idx(2);
+            relations.close().unwrap();
+
+            let mut relation_members = builder.start_relation_members().unwrap();
+            let mut members = relation_members.grow().unwrap();
+            let member = members.add_way_member();
+            member.set_way_idx(Some(0));
+            member.set_role_idx(if corrupt == Corrupt::Relations {
+                10_000 // beyond the stringtable
+            } else {
+                string_idx("outer")
+            });
+            relation_members.close().unwrap();
+
+            let mut header = osmflat::Header::new();
+            if corrupt == Corrupt::Header {
+                header.set_required_feature_first_idx(10_000); // beyond the stringtable
+                header.set_required_features_size(1);
+            }
+            builder.set_header(&header).unwrap();
+
+            if corrupt == Corrupt::Stringtable {
+                strings.push(b'x'); // unterminated trailing string
+            }
+            builder.set_stringtable(&strings).unwrap();
+        }
+        Osm::open(storage).unwrap()
+    }
+
+    #[test]
+    fn test_intact_archive_passes_all_checks() {
+        let archive = build_archive(Corrupt::Nothing);
+        for (name, check) in &checks() {
+            assert_eq!(check(&archive), Vec::<String>::new(), "check: {}", name);
+        }
+    }
+
+    #[test]
+    fn test_each_check_catches_its_corruption() {
+        let cases = [
+            (Corrupt::Stringtable, "stringtable"),
+            (Corrupt::Header, "header"),
+            (Corrupt::Nodes, "nodes"),
+            (Corrupt::Ways, "ways"),
+            (Corrupt::Relations, "relations"),
+            (Corrupt::Tags, "tags"),
+            (Corrupt::TagsIndex, "tags_index"),
+            (Corrupt::NodesIndex, "nodes_index"),
+            (Corrupt::Sentinels, "sentinels"),
+        ];
+        for &(corrupt, expected) in &cases {
+            let archive = build_archive(corrupt);
+            let (_, check) = checks()
+                .iter()
+                .cloned()
+                .find(|(name, _)| *name == expected)
+                .unwrap();
+            assert!(
+                !check(&archive).is_empty(),
+                "{} must report a violation for {:?}",
+                expected,
+                corrupt
+            );
+        }
+    }
+}
@@ -0,0 +1,153 @@
+//! Benchmarks of the read-side tag primitives.
+//!
+//! The archive is built synthetically in memory via
+//! `flatdata::MemoryResourceStorage`, so the suite needs no checked-in
+//! fixture. Plain `harness = false` target with a minimal `Instant` based
+//! runner; run with `cargo bench -p osmflat`.
+
+use osmflat::{find_tag, has_tag, iter_tags, Osm};
+
+use std::collections::HashMap;
+use std::hint::black_box;
+use std::time::{Duration, Instant};
+
+/// Runs `f` repeatedly until the measurement is long enough to be stable and
+/// prints the time per iteration.
+fn bench(name: &str, mut f: impl FnMut()) {
+    f(); // warmup
+    let mut iters: u32 = 1;
+    let elapsed = loop {
+        let start = Instant::now();
+        for _ in 0..iters {
+            f();
+        }
+        let elapsed = start.elapsed();
+        if elapsed >= Duration::from_millis(200) {
+            break elapsed;
+        }
+        iters = iters.saturating_mul(2);
+    };
+    println!(
+        "{:<40} {:>12.1} ns/iter ({} iters)",
+        name,
+        elapsed.as_nanos() as f64 / f64::from(iters),
+        iters
+    );
+}
+
+fn pseudo_random(state: &mut u64) -> u64 {
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    *state
+}
+
+const NUM_NODES: usize = 1000;
+const TAGS_PER_NODE: usize = 4;
+
+/// Builds an in-memory archive of `NUM_NODES` tagged nodes.
+fn build_archive() -> Osm {
+    let keys = ["highway", "name", "amenity", "surface", "maxspeed", "ref"];
+    let values = ["primary", "secondary", "yes", "asphalt", "50", "A1"];
+
+    let storage = flatdata::MemoryResourceStorage::new("/bench");
+    let builder = osmflat::OsmBuilder::new(storage.clone()).unwrap();
+
+    let mut stringtable = vec![0_u8]; // empty string at index 0
+    let mut string_index = HashMap::new();
+    let mut insert_string = |s: &str| -> u64 {
+        let stringtable = &mut stringtable;
+        *string_index.entry(s.to_string()).or_insert_with(|| {
+            let idx = stringtable.len() as u64;
+            stringtable.extend_from_slice(s.as_bytes());
+            stringtable.push(b'\0');
+            idx
+        })
+    };
+
+    let mut tags = builder.start_tags().unwrap();
+    let mut tags_index = builder.start_tags_index().unwrap();
+    let mut tag_dedup = HashMap::new();
+    let mut nodes = builder.start_nodes().unwrap();
+    let mut state = 0x2545_f491_4f6c_dd1d;
+    for i in 0..NUM_NODES {
+        let node = nodes.grow().unwrap();
+        node.set_id(i as i64);
+        node.set_lat(pseudo_random(&mut state) as i64 % 1_000_000);
+        node.set_lon(pseudo_random(&mut state) as i64 % 1_000_000);
+        node.set_tag_first_idx(tags_index.len() as u64);
+        for t in 0..TAGS_PER_NODE {
+            let key = keys[(i + t) % keys.len()];
+            let value = values[(pseudo_random(&mut state) % values.len() as u64) as usize];
+            let key_idx = insert_string(key);
+            let value_idx = insert_string(value);
+            let tag_idx = match tag_dedup.get(&(key_idx, value_idx)) {
+                Some(&idx) => idx,
+                None => {
+                    let idx = tags.len() as u64;
+                    let tag = tags.grow().unwrap();
+                    tag.set_key_idx(key_idx);
+                    tag.set_value_idx(value_idx);
+                    tag_dedup.insert((key_idx, value_idx), idx);
+                    idx
+                }
+            };
+            tags_index.grow().unwrap().set_value(tag_idx);
+        }
+    }
+    let num_tags_index = tags_index.len() as u64;
+    nodes.grow().unwrap().set_tag_first_idx(num_tags_index);
+    nodes.close().unwrap();
+    tags.close().unwrap();
+    tags_index.close().unwrap();
+
+    let mut ways = builder.start_ways().unwrap();
+    ways.grow().unwrap().set_tag_first_idx(num_tags_index);
+    ways.close().unwrap();
+    builder.start_nodes_index().unwrap().close().unwrap();
+
+    let mut relations = builder.start_relations().unwrap();
+    relations.grow().unwrap().set_tag_first_idx(num_tags_index);
+    relations.close().unwrap();
+    builder.start_relation_members().unwrap().close().unwrap();
+
+    builder.set_header(&osmflat::Header::new()).unwrap();
+    builder.set_stringtable(&stringtable).unwrap();
+
+    Osm::open(storage).unwrap()
+}
+
+fn main() {
+    let archive = build_archive();
+    let nodes = archive.nodes();
+
+    bench("tags/iter_tags all nodes", || {
+        let mut num_bytes = 0_usize;
+        for node in nodes {
+            for (key, value) in iter_tags(&archive, node.tags()) {
+                num_bytes += key.len() + value.len();
+            }
+        }
+        black_box(num_bytes);
+    });
+
+    bench("tags/find_tag all nodes", || {
+        let mut num_hits = 0_usize;
+        for node in nodes {
+            if find_tag(&archive, node.tags(), b"name").is_some() {
+                num_hits += 1;
+            }
+        }
+        black_box(num_hits);
+    });
+
+    bench("tags/has_tag all nodes", || {
+        let mut num_hits = 0_usize;
+        for node in nodes {
+            if has_tag(&archive, node.tags(), b"highway", b"primary") {
+                num_hits += 1;
+            }
+        }
+        black_box(num_hits);
+    });
+}
@@ -3,7 +3,7 @@
 //!
 //! Demonstrates
 //!
-//!  * iteration through ways
+//!  * parallel iteration through ways
 //!  * accessing of tags belonging to a way
 //!  * accessing of nodes belonging to a way
 //!  * length calculation on the Earth using the haversine function
@@ -13,7 +13,8 @@
 //! The code in this example file is released into the Public Domain.
 
 use itertools::Itertools;
-use osmflat::{FileResourceStorage, Node, Osm};
+use osmflat::{parallel, FileResourceStorage, Node, Osm};
+use rayon::prelude::*;
 
 struct Coords {
     lat: f64,
@@ -51,7 +52,7 @@ fn main() -> Result<(), Box<dyn std::error::Error>> {
     let tags_index = archive.tags_index();
     let strings = archive.stringtable();
 
-    let highways = archive.ways().iter().filter(|way| {
+    let highways = parallel::par_ways(&archive).filter(|way| {
         way.tags().any(|idx| {
             // A way reference a range of tags by storing a contiguous range of
             // indexes in `tags_index`. Each of these references a tag in `tags`.
@@ -0,0 +1,174 @@
+//! Page-cache control for the memory mapped archive resources.
+//!
+//! `Osm::open` maps the resources lazily: a cold scan faults pages in 4 KB
+//! at a time and the first queries after a deploy pay the full disk latency
+//! per page. This module lets readers declare their access intent per
+//! resource via `madvise` — sequential readahead before a full scan, random
+//! for point lookups, willneed to prewarm — and offers [`warmup`], which
+//! faults selected resources into the page cache in parallel. On
+//! non-Unix platforms all advice calls are no-ops.
+
+use crate::Osm;
+
+use rayon::prelude::*;
+
+use std::io;
+
+/// Access intent declared to the OS for a mapped resource.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum Advice {
+    /// Default kernel readahead.
+    Normal,
+    /// The resource will be scanned front to back; enables aggressive
+    /// readahead.
+    Sequential,
+    /// The resource will be accessed at random points; disables readahead,
+    /// so point lookups do not evict other pages.
+    Random,
+    /// The resource will be needed soon; the kernel starts reading it in.
+    WillNeed,
+}
+
+/// Archive resource addressable by the advice and warmup calls.
+///
+/// `relation_members` is not addressable since its view does not expose the
+/// underlying storage.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+#[allow(missing_docs)]
+pub enum Resource {
+    Nodes,
+    Ways,
+    Relations,
+    Tags,
+    TagsIndex,
+    NodesIndex,
+    Stringtable,
+}
+
+impl Resource {
+    /// All addressable resources.
+    pub const ALL: [Resource; 7] = [
+        Resource::Nodes,
+        Resource::Ways,
+        Resource::Relations,
+        Resource::Tags,
+        Resource::TagsIndex,
+        Resource::NodesIndex,
+        Resource::Stringtable,
+    ];
+
+    /// The resources dereferenced by every tag access:
+    /// `tags`, `tags_index` and the `stringtable`.
+    pub const TAG_LOOKUP: [Resource; 3] =
+        [Resource::Tags, Resource::TagsIndex, Resource::Stringtable];
+}
+
+/// Reinterprets a resource slice as its underlying bytes.
+///
+/// Safety: all generated flatdata structs are `repr(transparent)` wrappers
+/// over fixed-size byte arrays without padding.
+fn bytes_of<T>(slice: &[T]) -> &[u8] {
+    unsafe {
+        std::slice::from_raw_parts(
+            slice.as_ptr() as *const u8,
+            slice.len() * std::mem::size_of::<T>(),
+        )
+    }
+}
+
+fn resource_bytes<'a>(archive: &'a Osm, resource: Resource) -> &'a [u8] {
+    match resource {
+        Resource::Nodes => bytes_of(archive.nodes()),
+        Resource::Ways => bytes_of(archive.ways()),
+        Resource::Relations => bytes_of(archive.relations()),
+        Resource::Tags => bytes_of(archive.tags()),
+        Resource::TagsIndex => bytes_of(archive.tags_index()),
+        Resource::NodesIndex => bytes_of(archive.nodes_index()),
+        Resource::Stringtable => archive.stringtable().as_bytes(),
+    }
+}
+
+/// Declares the access intent for a byte range, typically a resource slice.
+///
+/// The range is widened to page boundaries as required by `madvise`.
+#[cfg(unix)]
+pub fn advise_range(data: &[u8], advice: Advice) -> io::Result<()> {
+    if data.is_empty() {
+        return Ok(());
+    }
+    let page_size = unsafe { libc::sysconf(libc::_SC_PAGESIZE) } as usize;
+    let start = data.as_ptr() as usize & !(page_size - 1);
+    let len = data.as_ptr() as usize + data.len() - start;
+    let advice = match advice {
+        Advice::Normal => libc::MADV_NORMAL,
+        Advice::Sequential => libc::MADV_SEQUENTIAL,
+        Advice::Random => libc::MADV_RANDOM,
+        Advice::WillNeed => libc::MADV_WILLNEED,
+    };
+    let ret = unsafe { libc::madvise(start as *mut libc::c_void, len, advice) };
+    if ret != 0 {
+        return Err(io::Error::last_os_error());
+    }
+    Ok(())
+}
+
+/// Declares the access intent for a byte range; no-op on this platform.
+#[cfg(not(unix))]
+pub fn advise_range(_data: &[u8], _advice: Advice) -> io::Result<()> {
+    Ok(())
+}
+
+/// Declares the access intent for the given archive resources.
+pub fn advise(archive: &Osm, resources: &[Resource], advice: Advice) -> io::Result<()> {
+    for &resource in resources {
+        advise_range(resource_bytes(archive, resource), advice)?;
+    }
+    Ok(())
+}
+
+/// Faults the given resources into the page cache, in parallel.
+///
+/// Announces the resources with [`Advice::WillNeed`] first, so the kernel
+/// reads ahead while the touch threads walk the pages. Afterwards a scan
+/// starts with the resources warm instead of faulting them in 4 KB at a
+/// time.
+pub fn warmup(archive: &Osm, resources: &[Resource]) -> io::Result<()> {
+    /// Touched pages per parallel work item.
+    const PAGES_PER_CHUNK: usize = 1024;
+
+    for &resource in resources {
+        advise_range(resource_bytes(archive, resource), Advice::WillNeed)?;
+    }
+    let page_size = 4096; // touching more often than needed is harmless
+    for &resource in resources {
+        let data = resource_bytes(archive, resource);
+        data.par_chunks(page_size * PAGES_PER_CHUNK).for_each(|chunk| {
+            for page in chunk.chunks(page_size) {
+                // volatile, so the faulting read is not optimized away
+                unsafe { std::ptr::read_volatile(page.as_ptr()) };
+            }
+        });
+    }
+    Ok(())
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    #[test]
+    fn test_advise_range() {
+        // heap memory is mapped, so madvise accepts it like an mmap'd resource
+        let data = vec![0_u8; 2 * 4096 + 1];
+        for &advice in &[
+            Advice::Normal,
+            Advice::Sequential,
+            Advice::Random,
+            Advice::WillNeed,
+        ] {
+            advise_range(&data, advice).unwrap();
+            advise_range(&data[1..17], advice).unwrap();
+        }
+        advise_range(&[], Advice::Sequential).unwrap();
+    }
+}
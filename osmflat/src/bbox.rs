@@ -0,0 +1,203 @@
+//! Precomputed way bounding boxes for spatial culling.
+//!
+//! Written by `osmflatc` next to the archive resources when converting with
+//! `--way-bboxes`. One 20 byte record per way stores the four bounds as
+//! 40-bit coordinates in the same encoding as `Node` lat/lon, so readers can
+//! cull ways against a viewport with one sequential scan instead of
+//! dereferencing every way's ref range through `nodes_index` into `nodes`.
+
+use crate::Osm;
+
+use memmap::Mmap;
+
+use std::convert::TryInto;
+use std::fs;
+use std::io::{self, BufWriter, Write};
+use std::path::Path;
+
+/// File name of the way bboxes resource inside an archive directory.
+pub const WAY_BBOXES_FILE_NAME: &str = "way_bboxes";
+
+const MAGIC: &[u8; 8] = b"OSMBBOX1";
+const RECORD_LEN: usize = 20;
+const HEADER_LEN: usize = MAGIC.len() + 8;
+
+/// Axis-aligned bounding box of a way.
+///
+/// Coordinates are scaled with [`COORD_SCALE`] like `Node` lat/lon.
+///
+/// [`COORD_SCALE`]: constant.COORD_SCALE.html
+#[derive(Debug, Clone, Copy, PartialEq)]
+pub struct WayBbox {
+    /// Minimal latitude of the way's nodes.
+    pub min_lat: i64,
+    /// Minimal longitude of the way's nodes.
+    pub min_lon: i64,
+    /// Maximal latitude of the way's nodes.
+    pub max_lat: i64,
+    /// Maximal longitude of the way's nodes.
+    pub max_lon: i64,
+}
+
+impl WayBbox {
+    /// Returns `true` if this bbox intersects the given bounds.
+    pub fn intersects(&self, min_lat: i64, min_lon: i64, max_lat: i64, max_lon: i64) -> bool {
+        self.min_lat <= max_lat
+            && self.max_lat >= min_lat
+            && self.min_lon <= max_lon
+            && self.max_lon >= min_lon
+    }
+}
+
+fn pack_coord(value: i64, buf: &mut [u8]) {
+    debug_assert!(-(1 << 39) <= value && value < (1 << 39));
+    buf.copy_from_slice(&value.to_le_bytes()[..5]);
+}
+
+fn unpack_coord(buf: &[u8]) -> i64 {
+    let mut bytes = [0_u8; 8];
+    bytes[..5].copy_from_slice(buf);
+    // sign-extend the 40-bit value
+    (i64::from_le_bytes(bytes) << 24) >> 24
+}
+
+/// Precomputed bounding boxes of all ways of an archive.
+///
+/// Only available for archives converted with `--way-bboxes`; `open` returns
+/// `NotFound` otherwise.
+#[derive(Debug)]
+pub struct WayBboxes {
+    data: Mmap,
+}
+
+impl WayBboxes {
+    /// Opens the way bboxes of the archive at `archive_dir`.
+    pub fn open(archive_dir: &Path) -> io::Result<Self> {
+        let file = fs::File::open(archive_dir.join(WAY_BBOXES_FILE_NAME))?;
+        let data = unsafe { Mmap::map(&file)? };
+        let invalid = |msg| io::Error::new(io::ErrorKind::InvalidData, msg);
+        if data.len() < HEADER_LEN || &data[..MAGIC.len()] != MAGIC {
+            return Err(invalid("invalid way bboxes magic"));
+        }
+        let num_ways = u64::from_le_bytes(data[MAGIC.len()..HEADER_LEN].try_into().unwrap());
+        if data.len() as u64 != HEADER_LEN as u64 + num_ways * RECORD_LEN as u64 {
+            return Err(invalid("truncated way bboxes"));
+        }
+        Ok(Self { data })
+    }
+
+    /// Number of ways covered by the resource.
+    pub fn len(&self) -> usize {
+        (self.data.len() - HEADER_LEN) / RECORD_LEN
+    }
+
+    /// Returns `true` if the resource covers no ways.
+    pub fn is_empty(&self) -> bool {
+        self.len() == 0
+    }
+
+    /// Returns the bbox of the way with the given index.
+    ///
+    /// Returns `None` for ways without any resolved node, which have no
+    /// geometry to cull against.
+    pub fn get(&self, way_idx: usize) -> Option<WayBbox> {
+        let record = &self.data[HEADER_LEN + way_idx * RECORD_LEN..][..RECORD_LEN];
+        let bbox = WayBbox {
+            min_lat: unpack_coord(&record[..5]),
+            min_lon: unpack_coord(&record[5..10]),
+            max_lat: unpack_coord(&record[10..15]),
+            max_lon: unpack_coord(&record[15..]),
+        };
+        if bbox.min_lat > bbox.max_lat {
+            None
+        } else {
+            Some(bbox)
+        }
+    }
+}
+
+/// Computes the bboxes of all ways of `archive` and writes them into the
+/// archive at `archive_dir`.
+///
+/// One post-pass over the ways; ways without any resolved node get an empty
+/// bbox record.
+pub fn write_way_bboxes(archive: &Osm, archive_dir: &Path) -> io::Result<()> {
+    let nodes = archive.nodes();
+    let nodes_index = archive.nodes_index();
+    let ways = archive.ways();
+
+    let file = fs::File::create(archive_dir.join(WAY_BBOXES_FILE_NAME))?;
+    let mut writer = BufWriter::new(file);
+    writer.write_all(MAGIC)?;
+    writer.write_all(&(ways.len() as u64).to_le_bytes())?;
+
+    let mut record = [0_u8; RECORD_LEN];
+    for way in ways {
+        let mut bbox = WayBbox {
+            min_lat: i64::max_value(),
+            min_lon: i64::max_value(),
+            max_lat: i64::min_value(),
+            max_lon: i64::min_value(),
+        };
+        for idx in way.refs() {
+            if let Some(node_idx) = nodes_index[idx as usize].value() {
+                let node = &nodes[node_idx as usize];
+                bbox.min_lat = bbox.min_lat.min(node.lat());
+                bbox.min_lon = bbox.min_lon.min(node.lon());
+                bbox.max_lat = bbox.max_lat.max(node.lat());
+                bbox.max_lon = bbox.max_lon.max(node.lon());
+            }
+        }
+        if bbox.min_lat > bbox.max_lat {
+            // empty bbox marker: min above max
+            bbox = WayBbox {
+                min_lat: 1,
+                min_lon: 1,
+                max_lat: 0,
+                max_lon: 0,
+            };
+        }
+        pack_coord(bbox.min_lat, &mut record[..5]);
+        pack_coord(bbox.min_lon, &mut record[5..10]);
+        pack_coord(bbox.max_lat, &mut record[10..15]);
+        pack_coord(bbox.max_lon, &mut record[15..]);
+        writer.write_all(&record)?;
+    }
+    writer.flush()
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    #[test]
+    fn test_coord_roundtrip() {
+        for &value in &[
+            0,
+            1,
+            -1,
+            180_000_000_000_i64,
+            -180_000_000_000_i64,
+            (1 << 39) - 1,
+            -(1 << 39),
+        ] {
+            let mut buf = [0_u8; 5];
+            pack_coord(value, &mut buf);
+            assert_eq!(unpack_coord(&buf), value);
+        }
+    }
+
+    #[test]
+    fn test_intersects() {
+        let bbox = WayBbox {
+            min_lat: 0,
+            min_lon: 0,
+            max_lat: 10,
+            max_lon: 10,
+        };
+        assert!(bbox.intersects(5, 5, 15, 15));
+        assert!(bbox.intersects(-5, -5, 0, 0));
+        assert!(!bbox.intersects(11, 0, 20, 10));
+        assert!(!bbox.intersects(0, -20, 10, -1));
+    }
+}
@@ -0,0 +1,183 @@
+//! Resolved way geometries stored contiguously.
+//!
+//! Written by `osmflatc` next to the archive resources when converting with
+//! `--way-geometries`. Reading a way's geometry through the archive means
+//! two dependent random accesses per point (`nodes_index` into `nodes`);
+//! this resource stores every way's resolved coordinates contiguously as
+//! zigzag/delta-encoded varints, so geometry-heavy readers stream points
+//! sequentially at disk bandwidth.
+
+use crate::Osm;
+
+use memmap::Mmap;
+
+use std::convert::TryInto;
+use std::fs;
+use std::io::{self, BufWriter, Write};
+use std::path::Path;
+
+/// File name of the way geometries resource inside an archive directory.
+pub const WAY_GEOMETRIES_FILE_NAME: &str = "way_geometries";
+
+const MAGIC: &[u8; 8] = b"OSMWGEO1";
+const HEADER_LEN: usize = MAGIC.len() + 8;
+
+fn zigzag_encode(value: i64) -> u64 {
+    ((value << 1) ^ (value >> 63)) as u64
+}
+
+fn zigzag_decode(value: u64) -> i64 {
+    ((value >> 1) as i64) ^ -((value & 1) as i64)
+}
+
+fn write_varint(out: &mut Vec<u8>, mut value: u64) {
+    while value >= 0x80 {
+        out.push((value as u8 & 0x7f) | 0x80);
+        value >>= 7;
+    }
+    out.push(value as u8);
+}
+
+fn read_varint(data: &[u8], cursor: &mut usize) -> u64 {
+    let mut value = 0_u64;
+    let mut shift = 0;
+    loop {
+        let byte = data[*cursor];
+        *cursor += 1;
+        value |= u64::from(byte & 0x7f) << shift;
+        if byte < 0x80 {
+            return value;
+        }
+        shift += 7;
+    }
+}
+
+/// Resolved geometries of all ways of an archive.
+///
+/// Only available for archives converted with `--way-geometries`; `open`
+/// returns `NotFound` otherwise.
+#[derive(Debug)]
+pub struct WayGeometries {
+    data: Mmap,
+    num_ways: usize,
+}
+
+impl WayGeometries {
+    /// Opens the way geometries of the archive at `archive_dir`.
+    pub fn open(archive_dir: &Path) -> io::Result<Self> {
+        let file = fs::File::open(archive_dir.join(WAY_GEOMETRIES_FILE_NAME))?;
+        let data = unsafe { Mmap::map(&file)? };
+        let invalid = |msg| io::Error::new(io::ErrorKind::InvalidData, msg);
+        if data.len() < HEADER_LEN || &data[..MAGIC.len()] != MAGIC {
+            return Err(invalid("invalid way geometries magic"));
+        }
+        let num_ways =
+            u64::from_le_bytes(data[MAGIC.len()..HEADER_LEN].try_into().unwrap()) as usize;
+        if data.len() < HEADER_LEN + (num_ways + 1) * 8 {
+            return Err(invalid("truncated way geometries"));
+        }
+        Ok(Self { data, num_ways })
+    }
+
+    /// Number of ways covered by the resource.
+    pub fn len(&self) -> usize {
+        self.num_ways
+    }
+
+    /// Returns `true` if the resource covers no ways.
+    pub fn is_empty(&self) -> bool {
+        self.num_ways == 0
+    }
+
+    fn offset(&self, i: usize) -> usize {
+        let entry = &self.data[HEADER_LEN + i * 8..][..8];
+        u64::from_le_bytes(entry.try_into().unwrap()) as usize
+    }
+
+    /// Returns an iterator over the resolved points of the way with the
+    /// given index, as `(lat, lon)` scaled with [`COORD_SCALE`].
+    ///
+    /// Nodes which were unresolved during conversion carry no coordinates
+    /// and are not part of the geometry.
+    ///
+    /// [`COORD_SCALE`]: constant.COORD_SCALE.html
+    pub fn points(&self, way_idx: usize) -> impl Iterator<Item = (i64, i64)> + '_ {
+        let payload_start = HEADER_LEN + (self.num_ways + 1) * 8;
+        let points = &self.data[payload_start + self.offset(way_idx)
+            ..payload_start + self.offset(way_idx + 1)];
+        let mut cursor = 0;
+        let mut lat = 0_i64;
+        let mut lon = 0_i64;
+        std::iter::from_fn(move || {
+            if cursor >= points.len() {
+                return None;
+            }
+            lat += zigzag_decode(read_varint(points, &mut cursor));
+            lon += zigzag_decode(read_varint(points, &mut cursor));
+            Some((lat, lon))
+        })
+    }
+}
+
+/// Resolves the geometries of all ways of `archive` and writes them into the
+/// archive at `archive_dir`.
+///
+/// One post-pass over the ways; each geometry is the delta of consecutive
+/// resolved points, zigzag-encoded as varints.
+pub fn write_way_geometries(archive: &Osm, archive_dir: &Path) -> io::Result<()> {
+    let nodes = archive.nodes();
+    let nodes_index = archive.nodes_index();
+    let ways = archive.ways();
+
+    let mut offsets = Vec::with_capacity(ways.len() + 1);
+    let mut payload = Vec::new();
+    for way in ways {
+        offsets.push(payload.len() as u64);
+        let mut prev = (0_i64, 0_i64);
+        for idx in way.refs() {
+            if let Some(node_idx) = nodes_index[idx as usize].value() {
+                let node = &nodes[node_idx as usize];
+                write_varint(&mut payload, zigzag_encode(node.lat() - prev.0));
+                write_varint(&mut payload, zigzag_encode(node.lon() - prev.1));
+                prev = (node.lat(), node.lon());
+            }
+        }
+    }
+    offsets.push(payload.len() as u64);
+
+    let file = fs::File::create(archive_dir.join(WAY_GEOMETRIES_FILE_NAME))?;
+    let mut writer = BufWriter::new(file);
+    writer.write_all(MAGIC)?;
+    writer.write_all(&(ways.len() as u64).to_le_bytes())?;
+    for offset in &offsets {
+        writer.write_all(&offset.to_le_bytes())?;
+    }
+    writer.write_all(&payload)?;
+    writer.flush()
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    #[test]
+    fn test_zigzag_roundtrip() {
+        for &value in &[0, 1, -1, 63, -64, i64::max_value(), i64::min_value()] {
+            assert_eq!(zigzag_decode(zigzag_encode(value)), value);
+        }
+    }
+
+    #[test]
+    fn test_varint_roundtrip() {
+        let values = [0_u64, 1, 127, 128, 300, 1 << 40, u64::max_value()];
+        let mut buffer = Vec::new();
+        for &value in &values {
+            write_varint(&mut buffer, value);
+        }
+        let mut cursor = 0;
+        for &value in &values {
+            assert_eq!(read_varint(&buffer, &mut cursor), value);
+        }
+        assert_eq!(cursor, buffer.len());
+    }
+}
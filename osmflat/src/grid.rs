@@ -0,0 +1,129 @@
+//! Spatial grid index over Hilbert-sorted nodes.
+//!
+//! Written by `osmflatc` next to the archive resources when converting with
+//! `--hilbert-sort`. The globe is divided into a `2^CELL_ORDER` x
+//! `2^CELL_ORDER` grid; since nodes are laid out along a Hilbert curve, all
+//! nodes of one grid cell form a contiguous range in the `nodes` vector, and
+//! the index stores the first node index of every cell.
+
+use crate::hilbert;
+
+use std::convert::TryInto;
+use std::fs;
+use std::io::{self, Read, Write};
+use std::ops::Range;
+use std::path::Path;
+
+/// Order of the grid the index is built on: the globe is divided into
+/// `2^CELL_ORDER` x `2^CELL_ORDER` cells.
+pub const CELL_ORDER: u32 = 8;
+
+/// File name of the grid index resource inside an archive directory.
+pub const GRID_INDEX_FILE_NAME: &str = "grid_index";
+
+const MAGIC: &[u8; 8] = b"OSMGRID1";
+
+/// Maps spatial grid cells to ranges of node indices.
+///
+/// Only available for archives converted with `--hilbert-sort`; `open`
+/// returns `NotFound` otherwise.
+#[derive(Debug)]
+pub struct GridIndex {
+    /// First node index of every cell, indexed by the cell's Hilbert rank,
+    /// with one sentinel entry containing the total number of nodes.
+    starts: Vec<u64>,
+}
+
+impl GridIndex {
+    /// Creates an index from the first node index of every cell.
+    ///
+    /// `starts` must contain one entry per grid cell plus a sentinel with the
+    /// total number of nodes, and must be non-decreasing.
+    pub fn new(starts: Vec<u64>) -> Self {
+        assert_eq!(starts.len() as u64, Self::num_cells() + 1);
+        debug_assert!(starts.windows(2).all(|w| w[0] <= w[1]));
+        Self { starts }
+    }
+
+    /// Opens the grid index of the archive at `archive_dir`.
+    pub fn open(archive_dir: &Path) -> io::Result<Self> {
+        let data = fs::read(archive_dir.join(GRID_INDEX_FILE_NAME))?;
+        let invalid = |msg| io::Error::new(io::ErrorKind::InvalidData, msg);
+
+        let mut reader = &data[..];
+        let mut magic = [0_u8; 8];
+        reader.read_exact(&mut magic)?;
+        if &magic != MAGIC {
+            return Err(invalid("invalid grid index magic"));
+        }
+        let mut cell_order = [0_u8; 4];
+        reader.read_exact(&mut cell_order)?;
+        if u32::from_le_bytes(cell_order) != CELL_ORDER {
+            return Err(invalid("unsupported grid index cell order"));
+        }
+
+        if reader.len() as u64 != (Self::num_cells() + 1) * 8 {
+            return Err(invalid("truncated grid index"));
+        }
+        let starts = reader
+            .chunks_exact(8)
+            .map(|entry| u64::from_le_bytes(entry.try_into().unwrap()))
+            .collect();
+        Ok(Self::new(starts))
+    }
+
+    /// Writes the index into the archive at `archive_dir`.
+    pub fn write(&self, archive_dir: &Path) -> io::Result<()> {
+        let file = fs::File::create(archive_dir.join(GRID_INDEX_FILE_NAME))?;
+        let mut writer = io::BufWriter::new(file);
+        writer.write_all(MAGIC)?;
+        writer.write_all(&CELL_ORDER.to_le_bytes())?;
+        for start in &self.starts {
+            writer.write_all(&start.to_le_bytes())?;
+        }
+        writer.flush()
+    }
+
+    /// Number of cells of the grid.
+    pub fn num_cells() -> u64 {
+        1 << (2 * CELL_ORDER)
+    }
+
+    /// Returns the cell containing the coordinates scaled with
+    /// [`COORD_SCALE`].
+    ///
+    /// [`COORD_SCALE`]: constant.COORD_SCALE.html
+    pub fn cell_at(lat: i64, lon: i64) -> u64 {
+        let (x, y) = hilbert::grid_coords(CELL_ORDER, lat, lon);
+        hilbert::rank(CELL_ORDER, x, y)
+    }
+
+    /// Returns the range of node indices inside the given cell.
+    pub fn node_range(&self, cell: u64) -> Range<u64> {
+        self.starts[cell as usize]..self.starts[cell as usize + 1]
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    #[test]
+    fn test_write_and_open_roundtrip() {
+        let dir = tempfile::tempdir().unwrap();
+
+        let mut starts = vec![0_u64; GridIndex::num_cells() as usize + 1];
+        for (cell, start) in starts.iter_mut().enumerate() {
+            *start = 3 * cell as u64;
+        }
+        GridIndex::new(starts).write(dir.path()).unwrap();
+
+        let index = GridIndex::open(dir.path()).unwrap();
+        assert_eq!(index.node_range(0), 0..3);
+        assert_eq!(index.node_range(42), 126..129);
+
+        let missing = tempfile::tempdir().unwrap();
+        let err = GridIndex::open(missing.path()).unwrap_err();
+        assert_eq!(err.kind(), io::ErrorKind::NotFound);
+    }
+}
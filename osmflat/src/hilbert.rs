@@ -0,0 +1,98 @@
+//! Hilbert space-filling curve used for the spatial node layout.
+//!
+//! Archives converted with spatial sorting lay out nodes along a Hilbert
+//! curve over the quantized coordinate grid, so that nodes which are close
+//! on the globe are also close in the `nodes` vector.
+
+use crate::COORD_SCALE;
+
+/// Returns the rank of the grid cell `(x, y)` on a Hilbert curve of the
+/// given order.
+///
+/// The curve covers a `2^order` x `2^order` grid; both coordinates must be
+/// smaller than `2^order`. Cells with consecutive ranks are always adjacent
+/// in the grid.
+pub fn rank(order: u32, mut x: u32, mut y: u32) -> u64 {
+    let side = 1_u32 << order;
+    debug_assert!(x < side && y < side);
+    let mut result = 0_u64;
+    let mut s = side >> 1;
+    while s > 0 {
+        let rx = u32::from(x & s > 0);
+        let ry = u32::from(y & s > 0);
+        result += u64::from(s) * u64::from(s) * u64::from((3 * rx) ^ ry);
+        // rotate the quadrant
+        if ry == 0 {
+            if rx == 1 {
+                x = side - 1 - x;
+                y = side - 1 - y;
+            }
+            std::mem::swap(&mut x, &mut y);
+        }
+        s >>= 1;
+    }
+    result
+}
+
+/// Quantizes coordinates scaled with [`COORD_SCALE`] to the `2^order` x
+/// `2^order` grid covering the whole globe.
+///
+/// Coordinates outside of the valid range are clamped to it.
+///
+/// [`COORD_SCALE`]: constant.COORD_SCALE.html
+pub fn grid_coords(order: u32, lat: i64, lon: i64) -> (u32, u32) {
+    const LAT_MAX: i64 = 90 * COORD_SCALE as i64;
+    const LON_MAX: i64 = 180 * COORD_SCALE as i64;
+    let side = 1_u128 << order;
+    let quantize = |value: i64, max: i64| -> u32 {
+        let value = value.max(-max).min(max);
+        ((value + max) as u128 * side / (2 * max as u128 + 1)) as u32
+    };
+    (quantize(lon, LON_MAX), quantize(lat, LAT_MAX))
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    #[test]
+    fn test_rank_is_a_hilbert_curve() {
+        const ORDER: u32 = 3;
+        const SIDE: u32 = 1 << ORDER;
+
+        let mut cell_of_rank = vec![None; (SIDE * SIDE) as usize];
+        for x in 0..SIDE {
+            for y in 0..SIDE {
+                let rank = rank(ORDER, x, y) as usize;
+                assert!(cell_of_rank[rank].is_none(), "rank {} not unique", rank);
+                cell_of_rank[rank] = Some((x, y));
+            }
+        }
+        // consecutive ranks are adjacent cells
+        for window in cell_of_rank.windows(2) {
+            let (x0, y0) = window[0].unwrap();
+            let (x1, y1) = window[1].unwrap();
+            let dist = (x0 as i32 - x1 as i32).abs() + (y0 as i32 - y1 as i32).abs();
+            assert_eq!(dist, 1, "cells {:?} and {:?} are not adjacent", window[0], window[1]);
+        }
+    }
+
+    #[test]
+    fn test_grid_coords_cover_the_grid() {
+        const ORDER: u32 = 10;
+        const SIDE: u32 = 1 << ORDER;
+        let scale = COORD_SCALE as i64;
+
+        assert_eq!(grid_coords(ORDER, -90 * scale, -180 * scale), (0, 0));
+        assert_eq!(
+            grid_coords(ORDER, 90 * scale, 180 * scale),
+            (SIDE - 1, SIDE - 1)
+        );
+        // out of range coordinates are clamped
+        assert_eq!(grid_coords(ORDER, -91 * scale, 181 * scale), (SIDE - 1, 0));
+
+        let (x, y) = grid_coords(ORDER, 0, 0);
+        assert!((i64::from(x) - i64::from(SIDE / 2)).abs() <= 1);
+        assert!((i64::from(y) - i64::from(SIDE / 2)).abs() <= 1);
+    }
+}
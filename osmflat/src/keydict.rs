@@ -0,0 +1,287 @@
+//! Perfect-hash dictionary of tag keys.
+//!
+//! Written by `osmflatc` next to the archive resources when converting with
+//! `--key-dict`. `find_tag` and `has_tag` compare the query key
+//! byte-by-byte against the stringtable for every tag of every entity. The
+//! dictionary maps each distinct tag-key string to its canonical
+//! stringtable offset through a minimal perfect hash, so a filter resolves
+//! its key once up front ([`KeyDict::resolve_key`]) and afterwards compares
+//! the entities' `key_idx` integers only.
+//!
+//! The hash is a CHD-style two-level function built without dependencies:
+//! keys are split into buckets, and per bucket a seed is searched which
+//! places all of its keys into free slots. A lookup therefore costs two
+//! hash evaluations plus one final string comparison against the candidate
+//! slot. A sorted list of all key offsets is stored alongside for
+//! enumeration.
+
+use crate::Osm;
+
+use memmap::Mmap;
+
+use std::collections::HashMap;
+use std::convert::TryInto;
+use std::fs;
+use std::io::{self, BufWriter, Write};
+use std::path::Path;
+
+/// File name of the key dictionary resource inside an archive directory.
+pub const KEY_DICT_FILE_NAME: &str = "key_dict";
+
+const MAGIC: &[u8; 8] = b"OSMKDIC1";
+/// magic, number of keys, number of buckets
+const HEADER_LEN: usize = MAGIC.len() + 2 * 8;
+/// Average number of keys per bucket of the two-level hash.
+const BUCKET_LOAD: usize = 4;
+/// Bound for the per-bucket seed search; reached only for degenerate input.
+const MAX_SEED: u32 = 1 << 20;
+
+/// Seeded FNV-1a with an avalanche finalizer.
+///
+/// Plain FNV is affine in its initial value, so for keys of equal length
+/// the hash differences would be identical for every seed and the seed
+/// search could never separate a colliding bucket; the splitmix64
+/// finalizer breaks that linearity.
+fn hash(key: &[u8], seed: u32) -> u64 {
+    let mut hash = 0xcbf2_9ce4_8422_2325_u64 ^ (u64::from(seed).wrapping_mul(0x9e37_79b9_7f4a_7c15));
+    for &byte in key {
+        hash ^= u64::from(byte);
+        hash = hash.wrapping_mul(0x100_0000_01b3);
+    }
+    hash ^= hash >> 30;
+    hash = hash.wrapping_mul(0xbf58_476d_1ce4_e5b9);
+    hash ^= hash >> 27;
+    hash = hash.wrapping_mul(0x94d0_49bb_1331_11eb);
+    hash ^ (hash >> 31)
+}
+
+fn num_buckets_for(num_keys: usize) -> usize {
+    (num_keys + BUCKET_LOAD - 1) / BUCKET_LOAD
+}
+
+/// Builds the two-level hash over `keys` and returns per-bucket seeds and
+/// the slot assignment (indices into `keys`).
+fn build_mph(keys: &[&[u8]]) -> io::Result<(Vec<u32>, Vec<u32>)> {
+    let num_buckets = num_buckets_for(keys.len());
+    let mut buckets: Vec<Vec<u32>> = vec![Vec::new(); num_buckets];
+    for (key_idx, key) in keys.iter().enumerate() {
+        buckets[(hash(key, 0) % num_buckets as u64) as usize].push(key_idx as u32);
+    }
+
+    // place large buckets first, while most slots are still free
+    let mut order: Vec<usize> = (0..num_buckets).collect();
+    order.sort_by_key(|&bucket| std::cmp::Reverse(buckets[bucket].len()));
+
+    let mut seeds = vec![0_u32; num_buckets];
+    let mut slots = vec![u32::max_value(); keys.len()];
+    let mut placed = Vec::new();
+    for bucket in order {
+        if buckets[bucket].is_empty() {
+            break; // the buckets are ordered by size
+        }
+        'seed: for seed in 1..MAX_SEED {
+            placed.clear();
+            for &key_idx in &buckets[bucket] {
+                let slot = (hash(keys[key_idx as usize], seed) % keys.len() as u64) as usize;
+                if slots[slot] != u32::max_value() || placed.contains(&slot) {
+                    continue 'seed;
+                }
+                placed.push(slot);
+            }
+            for (&slot, &key_idx) in placed.iter().zip(&buckets[bucket]) {
+                slots[slot] = key_idx;
+            }
+            seeds[bucket] = seed;
+            break;
+        }
+        if seeds[bucket] == 0 {
+            return Err(io::Error::new(
+                io::ErrorKind::InvalidData,
+                "could not build perfect hash over tag keys",
+            ));
+        }
+    }
+    Ok((seeds, slots))
+}
+
+/// Perfect-hash dictionary of all tag keys of an archive.
+///
+/// Only available for archives converted with `--key-dict`; `open` returns
+/// `NotFound` otherwise.
+#[derive(Debug)]
+pub struct KeyDict {
+    data: Mmap,
+    num_keys: usize,
+    num_buckets: usize,
+}
+
+impl KeyDict {
+    /// Opens the key dictionary of the archive at `archive_dir`.
+    pub fn open(archive_dir: &Path) -> io::Result<Self> {
+        let file = fs::File::open(archive_dir.join(KEY_DICT_FILE_NAME))?;
+        let data = unsafe { Mmap::map(&file)? };
+        let invalid = |msg| io::Error::new(io::ErrorKind::InvalidData, msg);
+        if data.len() < HEADER_LEN || &data[..MAGIC.len()] != MAGIC {
+            return Err(invalid("invalid key dictionary magic"));
+        }
+        let num_keys =
+            u64::from_le_bytes(data[MAGIC.len()..MAGIC.len() + 8].try_into().unwrap()) as usize;
+        let num_buckets =
+            u64::from_le_bytes(data[MAGIC.len() + 8..HEADER_LEN].try_into().unwrap()) as usize;
+        if num_buckets != num_buckets_for(num_keys)
+            || data.len() < HEADER_LEN + num_buckets * 4 + 2 * num_keys * 8
+        {
+            return Err(invalid("truncated key dictionary"));
+        }
+        Ok(Self {
+            data,
+            num_keys,
+            num_buckets,
+        })
+    }
+
+    /// Number of distinct tag keys in the dictionary.
+    pub fn len(&self) -> usize {
+        self.num_keys
+    }
+
+    /// Returns `true` if the archive has no tag keys.
+    pub fn is_empty(&self) -> bool {
+        self.num_keys == 0
+    }
+
+    fn seed(&self, bucket: usize) -> u32 {
+        let entry = &self.data[HEADER_LEN + bucket * 4..][..4];
+        u32::from_le_bytes(entry.try_into().unwrap())
+    }
+
+    fn slot_offset(&self, slot: usize) -> u64 {
+        let entry = &self.data[HEADER_LEN + self.num_buckets * 4 + slot * 8..][..8];
+        u64::from_le_bytes(entry.try_into().unwrap())
+    }
+
+    /// Stringtable offset of the `i`-th key in sorted offset order.
+    pub fn sorted_key_offset(&self, i: usize) -> u64 {
+        let start = HEADER_LEN + self.num_buckets * 4 + self.num_keys * 8;
+        let entry = &self.data[start + i * 8..][..8];
+        u64::from_le_bytes(entry.try_into().unwrap())
+    }
+
+    /// Resolves a tag key to its canonical stringtable offset.
+    ///
+    /// After resolving, filters compare entities' `key_idx` against the
+    /// returned offset instead of comparing strings per entity.
+    pub fn resolve_key(&self, archive: &Osm, key: &[u8]) -> Option<u64> {
+        self.resolve_key_in(archive.stringtable().as_bytes(), key)
+    }
+
+    /// Resolves a tag key against the given raw stringtable bytes.
+    pub fn resolve_key_in(&self, strings: &[u8], key: &[u8]) -> Option<u64> {
+        if self.num_keys == 0 {
+            return None;
+        }
+        let seed = self.seed((hash(key, 0) % self.num_buckets as u64) as usize);
+        if seed == 0 {
+            return None; // empty bucket
+        }
+        let offset = self.slot_offset((hash(key, seed) % self.num_keys as u64) as usize);
+        // one final comparison verifies the candidate slot
+        let block = strings.get(offset as usize..)?;
+        if block.starts_with(key) && *block.get(key.len()).unwrap_or(&0) == 0 {
+            Some(offset)
+        } else {
+            None
+        }
+    }
+}
+
+/// Builds the dictionary over the given distinct `(key bytes, offset)`
+/// entries and writes it into the archive at `archive_dir`.
+fn write_dict(entries: &[(&[u8], u64)], archive_dir: &Path) -> io::Result<()> {
+    let keys: Vec<&[u8]> = entries.iter().map(|(key, _)| *key).collect();
+    let (seeds, slots) = build_mph(&keys)?;
+
+    let mut sorted_offsets: Vec<u64> = entries.iter().map(|(_, offset)| *offset).collect();
+    sorted_offsets.sort_unstable();
+
+    let file = fs::File::create(archive_dir.join(KEY_DICT_FILE_NAME))?;
+    let mut writer = BufWriter::new(file);
+    writer.write_all(MAGIC)?;
+    writer.write_all(&(entries.len() as u64).to_le_bytes())?;
+    writer.write_all(&(seeds.len() as u64).to_le_bytes())?;
+    for seed in &seeds {
+        writer.write_all(&seed.to_le_bytes())?;
+    }
+    for &slot in &slots {
+        writer.write_all(&entries[slot as usize].1.to_le_bytes())?;
+    }
+    for offset in &sorted_offsets {
+        writer.write_all(&offset.to_le_bytes())?;
+    }
+    writer.flush()
+}
+
+/// Collects all distinct tag keys of `archive` and writes their dictionary
+/// into the archive at `archive_dir`.
+///
+/// Keys are canonicalized by their bytes: should several stringtable
+/// offsets spell the same key, the dictionary maps it to the smallest one.
+/// Tables written by `osmflatc` are deduplicated, so there the canonical
+/// offset is the one all tags reference.
+pub fn write_key_dict(archive: &Osm, archive_dir: &Path) -> io::Result<()> {
+    let strings = archive.stringtable();
+    let mut keys: HashMap<&[u8], u64> = HashMap::new();
+    for tag in archive.tags() {
+        let key = strings.substring_raw(tag.key_idx() as usize);
+        let offset = keys.entry(key).or_insert(tag.key_idx());
+        *offset = (*offset).min(tag.key_idx());
+    }
+    let entries: Vec<(&[u8], u64)> = keys.into_iter().collect();
+    write_dict(&entries, archive_dir)
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    #[test]
+    fn test_build_and_resolve_roundtrip() {
+        // synthetic stringtable interleaving keys with other strings
+        let mut strings = vec![0_u8];
+        let mut entries: Vec<(Vec<u8>, u64)> = Vec::new();
+        for i in 0..100 {
+            let key = format!("key_{}", i);
+            entries.push((key.as_bytes().to_vec(), strings.len() as u64));
+            strings.extend_from_slice(key.as_bytes());
+            strings.push(b'\0');
+            strings.extend_from_slice(format!("value_{}\0", i).as_bytes());
+        }
+
+        let dir = tempfile::tempdir().unwrap();
+        let borrowed: Vec<(&[u8], u64)> =
+            entries.iter().map(|(key, offset)| (&key[..], *offset)).collect();
+        write_dict(&borrowed, dir.path()).unwrap();
+
+        let dict = KeyDict::open(dir.path()).unwrap();
+        assert_eq!(dict.len(), entries.len());
+        for (key, offset) in &entries {
+            assert_eq!(dict.resolve_key_in(&strings, key), Some(*offset));
+        }
+        assert_eq!(dict.resolve_key_in(&strings, b"value_7"), None);
+        assert_eq!(dict.resolve_key_in(&strings, b"key_100"), None);
+        assert_eq!(dict.resolve_key_in(&strings, b""), None);
+
+        // the sorted key list enumerates every key offset
+        let offsets: Vec<u64> = (0..dict.len()).map(|i| dict.sorted_key_offset(i)).collect();
+        let mut expected: Vec<u64> = entries.iter().map(|(_, offset)| *offset).collect();
+        expected.sort_unstable();
+        assert_eq!(offsets, expected);
+    }
+
+    #[test]
+    fn test_open_missing() {
+        let dir = tempfile::tempdir().unwrap();
+        let err = KeyDict::open(dir.path()).unwrap_err();
+        assert_eq!(err.kind(), io::ErrorKind::NotFound);
+    }
+}
@@ -41,6 +41,17 @@ extern crate flatdata;
 // generated osm module
 include!("osmflat_generated.rs");
 
+pub mod advise;
+pub mod bbox;
+pub mod coords;
+pub mod geometry;
+pub mod grid;
+pub mod hilbert;
+pub mod keydict;
+pub mod pack;
+pub mod parallel;
+pub mod strings;
+pub mod tagindex;
 mod tags;
 
 pub use crate::osm::*;
@@ -0,0 +1,461 @@
+//! Block-compressed cold-tier container for osmflat archives.
+//!
+//! An archive directory is packed into a single `.osmpack` file: every
+//! resource is chunked into fixed-size blocks, each block is deflated
+//! independently, and a directory of block offsets is appended so a block
+//! can be located and decoded without touching its neighbours. The index
+//! resources in particular (`nodes_index`, `tags_index`) are full of
+//! low-entropy 40-bit values and shrink several-fold.
+//!
+//! A packed file is opened through the regular [`Osm`] API via
+//! [`open_storage`]. flatdata archives bind all of their resources during
+//! `open` and borrow whole-resource slices from the storage, so the packed
+//! storage decodes the resources into memory up front (blocks in
+//! parallel); random access afterwards is plain memory access. Callers
+//! that only need byte ranges of a cold resource can avoid the full decode
+//! with [`PackedArchive::read_range`], which decodes just the covered
+//! blocks through a small LRU cache.
+
+use flatdata::{MemoryResourceStorage, ResourceStorage, StorageHandle};
+use memmap::Mmap;
+use rayon::prelude::*;
+
+use std::collections::HashMap;
+use std::convert::TryInto;
+use std::fs;
+use std::io::{self, Read, Seek, SeekFrom, Write};
+use std::ops::Range;
+use std::path::{Path, PathBuf};
+use std::sync::{Arc, Mutex};
+
+const MAGIC: &[u8; 8] = b"OSMPACK1";
+/// magic, block size, directory offset
+const HEADER_LEN: usize = MAGIC.len() + 2 * 8;
+/// Uncompressed size of a block. Large enough to amortize the per-block
+/// deflate overhead, small enough that a point lookup decodes little data.
+const DEFAULT_BLOCK_SIZE: usize = 1 << 20;
+/// Number of decoded blocks kept by the LRU cache of [`PackedArchive`].
+const BLOCK_CACHE_BLOCKS: usize = 64;
+
+/// One packed resource: its uncompressed size and the compressed byte
+/// ranges of its blocks within the container file.
+#[derive(Debug)]
+struct Entry {
+    raw_len: usize,
+    blocks: Vec<Range<usize>>,
+}
+
+fn invalid(msg: &str) -> io::Error {
+    io::Error::new(io::ErrorKind::InvalidData, msg)
+}
+
+fn read_u64(data: &[u8], pos: &mut usize) -> io::Result<u64> {
+    let bytes = data
+        .get(*pos..*pos + 8)
+        .ok_or_else(|| invalid("truncated packed archive directory"))?;
+    *pos += 8;
+    Ok(u64::from_le_bytes(bytes.try_into().unwrap()))
+}
+
+fn decompress_block(compressed: &[u8], raw_len: usize) -> io::Result<Vec<u8>> {
+    let mut block = Vec::with_capacity(raw_len);
+    flate2::read::ZlibDecoder::new(compressed).read_to_end(&mut block)?;
+    if block.len() != raw_len {
+        return Err(invalid("block size mismatch in packed archive"));
+    }
+    Ok(block)
+}
+
+/// Decoded-block LRU cache keyed by (entry, block index).
+///
+/// Bounds the memory of range reads to `BLOCK_CACHE_BLOCKS` blocks; with
+/// the default block size that is 64 MiB.
+#[derive(Debug, Default)]
+struct BlockCache {
+    blocks: Vec<((usize, usize), Arc<Vec<u8>>)>,
+}
+
+impl BlockCache {
+    fn get(&mut self, key: (usize, usize)) -> Option<Arc<Vec<u8>>> {
+        let pos = self.blocks.iter().position(|(k, _)| *k == key)?;
+        let entry = self.blocks.remove(pos);
+        let block = entry.1.clone();
+        self.blocks.push(entry); // most recently used last
+        Some(block)
+    }
+
+    fn insert(&mut self, key: (usize, usize), block: Arc<Vec<u8>>) {
+        if self.blocks.len() == BLOCK_CACHE_BLOCKS {
+            self.blocks.remove(0);
+        }
+        self.blocks.push((key, block));
+    }
+}
+
+/// A packed osmflat archive opened for block-granular reading.
+///
+/// This is the low-level access path; to open the archive through the
+/// [`Osm`] API use [`PackedStorage`].
+#[derive(Debug)]
+pub struct PackedArchive {
+    data: Mmap,
+    block_size: usize,
+    entries: Vec<Entry>,
+    names: HashMap<PathBuf, usize>,
+    cache: Mutex<BlockCache>,
+}
+
+impl PackedArchive {
+    /// Opens the packed archive file at `path`.
+    pub fn open<P: AsRef<Path>>(path: P) -> io::Result<Self> {
+        let file = fs::File::open(path)?;
+        let data = unsafe { Mmap::map(&file)? };
+        if data.len() < HEADER_LEN || &data[..MAGIC.len()] != MAGIC {
+            return Err(invalid("invalid packed archive magic"));
+        }
+        let mut pos = MAGIC.len();
+        let block_size = read_u64(&data, &mut pos)? as usize;
+        let mut pos = read_u64(&data, &mut pos)? as usize;
+        if block_size == 0 || pos > data.len() {
+            return Err(invalid("invalid packed archive header"));
+        }
+
+        let num_entries = read_u64(&data, &mut pos)?;
+        let mut entries = Vec::new();
+        let mut names = HashMap::new();
+        for _ in 0..num_entries {
+            let name_len = read_u64(&data, &mut pos)? as usize;
+            let name = data
+                .get(pos..pos + name_len)
+                .ok_or_else(|| invalid("truncated packed archive directory"))?;
+            let name = std::str::from_utf8(name)
+                .map_err(|_| invalid("invalid resource name in packed archive"))?
+                .to_string();
+            pos += name_len;
+            let raw_len = read_u64(&data, &mut pos)? as usize;
+            let num_blocks = read_u64(&data, &mut pos)? as usize;
+            if num_blocks != (raw_len + block_size - 1) / block_size {
+                return Err(invalid("inconsistent block count in packed archive"));
+            }
+            let mut offset = read_u64(&data, &mut pos)? as usize;
+            let mut blocks = Vec::with_capacity(num_blocks);
+            for _ in 0..num_blocks {
+                let len = read_u64(&data, &mut pos)? as usize;
+                if data.len() < offset + len {
+                    return Err(invalid("block out of bounds in packed archive"));
+                }
+                blocks.push(offset..offset + len);
+                offset += len;
+            }
+            names.insert(PathBuf::from(name), entries.len());
+            entries.push(Entry { raw_len, blocks });
+        }
+        Ok(Self {
+            data,
+            block_size,
+            entries,
+            names,
+            cache: Mutex::new(BlockCache::default()),
+        })
+    }
+
+    /// Names of all packed resources (including schemas), in packing order.
+    pub fn resource_names(&self) -> impl Iterator<Item = &Path> {
+        let mut names: Vec<(&PathBuf, &usize)> = self.names.iter().collect();
+        names.sort_by_key(|(_, idx)| **idx);
+        names.into_iter().map(|(name, _)| name.as_path())
+    }
+
+    /// Returns `true` if the archive contains a resource with this name.
+    pub fn contains(&self, name: &Path) -> bool {
+        self.names.contains_key(name)
+    }
+
+    /// Uncompressed size of the resource, if it exists.
+    pub fn resource_len(&self, name: &Path) -> Option<usize> {
+        Some(self.entries[*self.names.get(name)?].raw_len)
+    }
+
+    fn entry(&self, name: &Path) -> io::Result<(usize, &Entry)> {
+        let idx = *self.names.get(name).ok_or_else(|| {
+            io::Error::new(
+                io::ErrorKind::NotFound,
+                String::from(name.to_str().unwrap_or("")),
+            )
+        })?;
+        Ok((idx, &self.entries[idx]))
+    }
+
+    fn raw_block_len(&self, entry: &Entry, block_idx: usize) -> usize {
+        (entry.raw_len - block_idx * self.block_size).min(self.block_size)
+    }
+
+    /// Decoded block, served from the LRU cache when possible.
+    fn block(&self, entry_idx: usize, block_idx: usize) -> io::Result<Arc<Vec<u8>>> {
+        if let Some(block) = self.cache.lock().unwrap().get((entry_idx, block_idx)) {
+            return Ok(block);
+        }
+        let entry = &self.entries[entry_idx];
+        let compressed = &self.data[entry.blocks[block_idx].clone()];
+        let block = Arc::new(decompress_block(
+            compressed,
+            self.raw_block_len(entry, block_idx),
+        )?);
+        self.cache
+            .lock()
+            .unwrap()
+            .insert((entry_idx, block_idx), block.clone());
+        Ok(block)
+    }
+
+    /// Reads a byte range of a resource, decoding only the covered blocks.
+    pub fn read_range(&self, name: &Path, range: Range<usize>) -> io::Result<Vec<u8>> {
+        let (entry_idx, entry) = self.entry(name)?;
+        if range.end > entry.raw_len || range.start > range.end {
+            return Err(invalid("range out of bounds"));
+        }
+        let mut result = Vec::with_capacity(range.end - range.start);
+        let mut pos = range.start;
+        while pos < range.end {
+            let block_idx = pos / self.block_size;
+            let block = self.block(entry_idx, block_idx)?;
+            let offset = pos - block_idx * self.block_size;
+            let len = (block.len() - offset).min(range.end - pos);
+            result.extend_from_slice(&block[offset..offset + len]);
+            pos += len;
+        }
+        Ok(result)
+    }
+
+    /// Reads a whole resource, decoding its blocks in parallel. Bypasses
+    /// the block cache so a scan does not evict the working set of
+    /// concurrent range reads.
+    pub fn read_all(&self, name: &Path) -> io::Result<Vec<u8>> {
+        let (_, entry) = self.entry(name)?;
+        let mut result = vec![0_u8; entry.raw_len];
+        let chunks: Vec<&mut [u8]> = result.chunks_mut(self.block_size.max(1)).collect();
+        entry
+            .blocks
+            .par_iter()
+            .zip(chunks)
+            .enumerate()
+            .try_for_each(|(block_idx, (compressed, chunk))| {
+                let block =
+                    decompress_block(&self.data[compressed.clone()], self.raw_block_len(entry, block_idx))?;
+                chunk.copy_from_slice(&block);
+                Ok(()) as io::Result<()>
+            })?;
+        Ok(result)
+    }
+}
+
+/// Opens the packed archive file at `path` as a flatdata resource storage.
+///
+/// Pass the result to [`Osm::open`] to read a packed archive through the
+/// regular API. flatdata archives read every resource during `open` and
+/// borrow slices from the storage, so the packed resources are decoded
+/// into memory here, blocks in parallel. Sidecar resources read directly
+/// from the archive directory (grid, key dictionary, ...) are not
+/// reachable through a storage handle; unpack the archive to use them.
+///
+/// ```rust,no_run
+/// use osmflat::{pack, Osm};
+///
+/// let storage = pack::open_storage("berlin.osmpack").unwrap();
+/// let archive = Osm::open(storage).unwrap();
+/// ```
+pub fn open_storage<P: AsRef<Path>>(path: P) -> io::Result<StorageHandle> {
+    let archive = PackedArchive::open(path.as_ref())?;
+    let storage = MemoryResourceStorage::new(path.as_ref());
+    for name in archive.resource_names() {
+        let name = name
+            .to_str()
+            .ok_or_else(|| invalid("non-utf8 resource name"))?;
+        // the container stores the resource files verbatim (size prefix and
+        // padding included), so the decoded bytes are the stream contents
+        let mut stream = storage.create_output_stream(name)?;
+        stream.write_all(&archive.read_all(Path::new(name))?)?;
+    }
+    Ok(storage)
+}
+
+/// Packs the osmflat archive directory at `archive_dir` into a single
+/// compressed container file at `output`.
+pub fn pack_archive(archive_dir: &Path, output: &Path) -> io::Result<()> {
+    pack_with(archive_dir, output, DEFAULT_BLOCK_SIZE)
+}
+
+fn pack_with(archive_dir: &Path, output: &Path, block_size: usize) -> io::Result<()> {
+    let mut names: Vec<PathBuf> = Vec::new();
+    for entry in fs::read_dir(archive_dir)? {
+        let entry = entry?;
+        if entry.file_type()?.is_file() {
+            names.push(entry.file_name().into());
+        }
+    }
+    names.sort(); // deterministic container layout
+
+    let mut writer = io::BufWriter::new(fs::File::create(output)?);
+    writer.write_all(MAGIC)?;
+    writer.write_all(&(block_size as u64).to_le_bytes())?;
+    writer.write_all(&0_u64.to_le_bytes())?; // directory offset, patched below
+    let mut offset = HEADER_LEN;
+
+    let mut directory: Vec<(PathBuf, usize, usize, Vec<usize>)> = Vec::new();
+    for name in names {
+        let first_offset = offset;
+        let data = fs::read(archive_dir.join(&name))?;
+        let blocks: Vec<Vec<u8>> = data
+            .par_chunks(block_size)
+            .map(|block| {
+                let mut encoder =
+                    flate2::write::ZlibEncoder::new(Vec::new(), flate2::Compression::default());
+                encoder.write_all(block)?;
+                encoder.finish()
+            })
+            .collect::<io::Result<_>>()?;
+        let mut block_lens = Vec::with_capacity(blocks.len());
+        for block in &blocks {
+            writer.write_all(block)?;
+            block_lens.push(block.len());
+        }
+        offset += block_lens.iter().sum::<usize>();
+        directory.push((name, data.len(), first_offset, block_lens));
+    }
+
+    let directory_offset = offset;
+    writer.write_all(&(directory.len() as u64).to_le_bytes())?;
+    for (name, raw_len, first_offset, block_lens) in directory {
+        let name = name
+            .to_str()
+            .ok_or_else(|| invalid("non-utf8 resource name"))?;
+        writer.write_all(&(name.len() as u64).to_le_bytes())?;
+        writer.write_all(name.as_bytes())?;
+        writer.write_all(&(raw_len as u64).to_le_bytes())?;
+        writer.write_all(&(block_lens.len() as u64).to_le_bytes())?;
+        writer.write_all(&(first_offset as u64).to_le_bytes())?;
+        for len in block_lens {
+            writer.write_all(&(len as u64).to_le_bytes())?;
+        }
+    }
+
+    let mut file = writer.into_inner()?;
+    file.seek(SeekFrom::Start(MAGIC.len() as u64 + 8))?;
+    file.write_all(&(directory_offset as u64).to_le_bytes())?;
+    file.sync_all()
+}
+
+/// Unpacks a packed archive file back into a plain archive directory.
+pub fn unpack_archive(packed_file: &Path, output_dir: &Path) -> io::Result<()> {
+    let archive = PackedArchive::open(packed_file)?;
+    fs::create_dir_all(output_dir)?;
+    for name in archive.resource_names() {
+        fs::write(output_dir.join(name), archive.read_all(name)?)?;
+    }
+    Ok(())
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+    use crate::Osm;
+
+    #[test]
+    fn test_read_range_decodes_only_covered_blocks() {
+        let dir = tempfile::tempdir().unwrap();
+        let input = dir.path().join("archive");
+        fs::create_dir(&input).unwrap();
+        let data: Vec<u8> = (0..10_000_u32).map(|i| (i % 251) as u8).collect();
+        fs::write(input.join("blob"), &data).unwrap();
+        fs::write(input.join("empty"), b"").unwrap();
+
+        let packed = dir.path().join("archive.osmpack");
+        pack_with(&input, &packed, 256).unwrap();
+
+        let archive = PackedArchive::open(&packed).unwrap();
+        assert_eq!(archive.resource_len(Path::new("blob")), Some(data.len()));
+        assert_eq!(archive.read_all(Path::new("blob")).unwrap(), data);
+        assert_eq!(archive.read_all(Path::new("empty")).unwrap(), b"");
+
+        // ranges within a block, across block borders, and repeated (cached)
+        for range in vec![0..10, 250..260, 0..data.len(), 9_990..10_000, 42..42, 250..260] {
+            assert_eq!(
+                archive.read_range(Path::new("blob"), range.clone()).unwrap(),
+                &data[range]
+            );
+        }
+        assert!(archive
+            .read_range(Path::new("blob"), 9_999..10_001)
+            .is_err());
+        assert_eq!(
+            archive.read_all(Path::new("missing")).unwrap_err().kind(),
+            io::ErrorKind::NotFound
+        );
+
+        let output = dir.path().join("unpacked");
+        unpack_archive(&packed, &output).unwrap();
+        assert_eq!(fs::read(output.join("blob")).unwrap(), data);
+    }
+
+    #[test]
+    fn test_packed_archive_opens_through_osm() {
+        let dir = tempfile::tempdir().unwrap();
+        let input = dir.path().join("archive");
+        {
+            let builder =
+                crate::OsmBuilder::new(flatdata::FileResourceStorage::new(input.clone())).unwrap();
+            let mut strings = vec![0_u8]; // empty string at offset 0
+            let mut string_idx = |s: &str| {
+                let idx = strings.len() as u64;
+                strings.extend_from_slice(s.as_bytes());
+                strings.push(b'\0');
+                idx
+            };
+            let mut tags = builder.start_tags().unwrap();
+            let mut tags_index = builder.start_tags_index().unwrap();
+            let mut nodes = builder.start_nodes().unwrap();
+            for id in 0..100_i64 {
+                let node = nodes.grow().unwrap();
+                node.set_id(id);
+                node.set_lat(id * 100);
+                node.set_tag_first_idx(tags_index.len() as u64);
+                let tag = tags.grow().unwrap();
+                tag.set_key_idx(string_idx("ref"));
+                tag.set_value_idx(string_idx(&id.to_string()));
+                tags_index.grow().unwrap().set_value(id as u64);
+            }
+            let num_tags_index = tags_index.len() as u64;
+            nodes.grow().unwrap().set_tag_first_idx(num_tags_index);
+            nodes.close().unwrap();
+            tags.close().unwrap();
+            tags_index.close().unwrap();
+            let mut ways = builder.start_ways().unwrap();
+            ways.grow().unwrap().set_tag_first_idx(num_tags_index);
+            ways.close().unwrap();
+            builder.start_nodes_index().unwrap().close().unwrap();
+            let mut relations = builder.start_relations().unwrap();
+            relations.grow().unwrap().set_tag_first_idx(num_tags_index);
+            relations.close().unwrap();
+            builder.start_relation_members().unwrap().close().unwrap();
+            builder.set_header(&crate::Header::new()).unwrap();
+            builder.set_stringtable(&strings).unwrap();
+        }
+
+        let packed = dir.path().join("archive.osmpack");
+        pack_with(&input, &packed, 512).unwrap();
+
+        let storage = open_storage(&packed).unwrap();
+        assert!(!storage.exists("grid"));
+        let archive = Osm::open(storage).unwrap();
+        let plain =
+            Osm::open(flatdata::FileResourceStorage::new(input.clone())).unwrap();
+        assert_eq!(archive.nodes().len(), plain.nodes().len());
+        for (node, expected) in archive.nodes().iter().zip(plain.nodes().iter()) {
+            assert_eq!(node.id(), expected.id());
+            assert_eq!(node.lat(), expected.lat());
+            let value = node.id().to_string();
+            let tags: Vec<_> = crate::iter_tags(&archive, node.tags()).collect();
+            assert_eq!(tags, vec![(&b"ref"[..], value.as_bytes())]);
+        }
+    }
+}
@@ -0,0 +1,38 @@
+//! Parallel iteration over the fundamental archive resources.
+//!
+//! The archive is memory mapped and read-only, so its vectors can be shared
+//! freely between threads. The iterators below split the entity vectors into
+//! chunks processed on the rayon thread pool. Since the range fields of
+//! `Node`, `Way` and `Relation` overlap with their successor (the sentinel
+//! convention), every element resolves its own `tags()` and `refs()` ranges
+//! locally, and a chunk needs no extra bookkeeping at its boundaries.
+
+use crate::{Node, Osm, Relation, Way};
+
+use rayon::prelude::*;
+
+/// Returns a parallel iterator over all nodes.
+///
+/// The node's tag range is available through `Node::tags` on each element.
+pub fn par_nodes(archive: &Osm) -> impl IndexedParallelIterator<Item = &Node> {
+    archive.nodes().par_iter()
+}
+
+/// Returns a parallel iterator over all ways.
+///
+/// The way's tag and ref ranges are available through `Way::tags` and
+/// `Way::refs` on each element.
+pub fn par_ways(archive: &Osm) -> impl IndexedParallelIterator<Item = &Way> {
+    archive.ways().par_iter()
+}
+
+/// Returns a parallel iterator over all relations with their indices.
+///
+/// The index addresses the relation's members in
+/// `archive.relation_members().at(idx)`; the tag range is available through
+/// `Relation::tags` on each element.
+pub fn par_relations(
+    archive: &Osm,
+) -> impl IndexedParallelIterator<Item = (usize, &Relation)> {
+    archive.relations().par_iter().enumerate()
+}
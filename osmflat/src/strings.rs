@@ -0,0 +1,135 @@
+//! Auxiliary sorted string offsets for constant-time string slicing.
+//!
+//! A string index in the archive is its byte offset into the `stringtable`
+//! resource, so `substring_raw` has to scan for the `\0` terminator on every
+//! access. `osmflatc` additionally writes the sorted start offsets of all
+//! strings next to the archive resources; with them the end of a string is
+//! simply the next start, and any string can be sliced without scanning its
+//! bytes.
+
+use memmap::Mmap;
+
+use std::convert::TryInto;
+use std::fs;
+use std::io::{self, BufWriter, Write};
+use std::ops::Range;
+use std::path::Path;
+
+/// File name of the string offsets resource inside an archive directory.
+pub const STRING_OFFSETS_FILE_NAME: &str = "stringtable_offsets";
+
+const MAGIC: &[u8; 8] = b"OSMSTRO1";
+const HEADER_LEN: usize = MAGIC.len();
+
+/// Sorted start offsets of all strings of the `stringtable` resource.
+///
+/// Only available for archives whose converter wrote the resource; `open`
+/// returns `NotFound` otherwise.
+#[derive(Debug)]
+pub struct StringOffsets {
+    /// Start offset of every string plus a sentinel with the table's size.
+    offsets: Vec<u64>,
+}
+
+impl StringOffsets {
+    /// Collects the string offsets of a serialized string table.
+    pub fn build(stringtable: &[u8]) -> Self {
+        let mut offsets = Vec::new();
+        if !stringtable.is_empty() {
+            offsets.push(0);
+        }
+        for (pos, _) in stringtable.iter().enumerate().filter(|(_, &b)| b == 0) {
+            offsets.push(pos as u64 + 1);
+        }
+        // the last terminator's successor is the size sentinel; a trailing
+        // unterminated string still gets one
+        if offsets.last() != Some(&(stringtable.len() as u64)) {
+            offsets.push(stringtable.len() as u64);
+        }
+        Self { offsets }
+    }
+
+    /// Opens the string offsets of the archive at `archive_dir`.
+    pub fn open(archive_dir: &Path) -> io::Result<Self> {
+        let file = fs::File::open(archive_dir.join(STRING_OFFSETS_FILE_NAME))?;
+        let data = unsafe { Mmap::map(&file)? };
+        let invalid = |msg| io::Error::new(io::ErrorKind::InvalidData, msg);
+        if data.len() < HEADER_LEN || &data[..MAGIC.len()] != MAGIC {
+            return Err(invalid("invalid string offsets magic"));
+        }
+        if (data.len() - HEADER_LEN) % 8 != 0 {
+            return Err(invalid("truncated string offsets"));
+        }
+        let offsets: Vec<u64> = data[HEADER_LEN..]
+            .chunks_exact(8)
+            .map(|entry| u64::from_le_bytes(entry.try_into().unwrap()))
+            .collect();
+        if offsets.is_empty() || offsets.windows(2).any(|w| w[0] > w[1]) {
+            return Err(invalid("string offsets are not sorted"));
+        }
+        Ok(Self { offsets })
+    }
+
+    /// Writes the offsets into the archive at `archive_dir`.
+    pub fn write(&self, archive_dir: &Path) -> io::Result<()> {
+        let file = fs::File::create(archive_dir.join(STRING_OFFSETS_FILE_NAME))?;
+        let mut writer = BufWriter::new(file);
+        writer.write_all(MAGIC)?;
+        for offset in &self.offsets {
+            writer.write_all(&offset.to_le_bytes())?;
+        }
+        writer.flush()
+    }
+
+    /// Number of strings in the table.
+    pub fn num_strings(&self) -> usize {
+        self.offsets.len().saturating_sub(1)
+    }
+
+    /// Returns the byte range of the string starting at `start`, without its
+    /// `\0` terminator.
+    ///
+    /// Returns `None` if `start` is not the start of a string. Runs in
+    /// `O(log n)` on the offsets instead of scanning the string's bytes.
+    pub fn substring_range(&self, start: u64) -> Option<Range<usize>> {
+        let pos = self.offsets.binary_search(&start).ok()?;
+        let end = *self.offsets.get(pos + 1)?;
+        // exclude the terminator of every string but an unterminated last one
+        Some(start as usize..end.max(start + 1) as usize - 1)
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    #[test]
+    fn test_build_and_slice() {
+        let data = b"hello\0world\0!\0";
+        let offsets = StringOffsets::build(data);
+        assert_eq!(offsets.num_strings(), 3);
+        assert_eq!(offsets.substring_range(0), Some(0..5));
+        assert_eq!(offsets.substring_range(6), Some(6..11));
+        assert_eq!(offsets.substring_range(12), Some(12..13));
+        // not a string start
+        assert_eq!(offsets.substring_range(1), None);
+        assert_eq!(offsets.substring_range(14), None);
+
+        assert_eq!(StringOffsets::build(b"").num_strings(), 0);
+    }
+
+    #[test]
+    fn test_write_and_open_roundtrip() {
+        let dir = tempfile::tempdir().unwrap();
+        let data = b"one\0two\0";
+        StringOffsets::build(data).write(dir.path()).unwrap();
+
+        let offsets = StringOffsets::open(dir.path()).unwrap();
+        assert_eq!(offsets.num_strings(), 2);
+        assert_eq!(offsets.substring_range(4), Some(4..7));
+
+        let missing = tempfile::tempdir().unwrap();
+        let err = StringOffsets::open(missing.path()).unwrap_err();
+        assert_eq!(err.kind(), io::ErrorKind::NotFound);
+    }
+}
@@ -0,0 +1,259 @@
+//! Per-key inverted tag index for `find_tag` style workloads.
+//!
+//! Written by `osmflatc` next to the archive resources when converting with
+//! `--tag-index`. For every distinct tag key the resource stores the sorted
+//! indices of all nodes, ways and relations carrying that key, so queries
+//! like "all entities with highway=*" become direct range reads instead of a
+//! linear scan over all tag index entries.
+//!
+//! Keys are identified by their byte offset into the `stringtable` resource,
+//! which is unique per key text since the table is deduplicated.
+
+use crate::Osm;
+
+use memmap::Mmap;
+
+use std::collections::BTreeMap;
+use std::convert::TryInto;
+use std::fs;
+use std::io::{self, BufWriter, Write};
+use std::path::Path;
+
+/// File name of the tag index resource inside an archive directory.
+pub const TAG_INDEX_FILE_NAME: &str = "tag_index";
+
+const MAGIC: &[u8; 8] = b"OSMTAGI1";
+const HEADER_LEN: usize = MAGIC.len() + 8;
+/// Directory entry: key offset plus the element offsets of the key's node,
+/// way and relation index runs in the payload.
+const DIR_ENTRY_LEN: usize = 32;
+
+/// Per-entity-type lists of one key's directory entry.
+type IndexedEntities = [Vec<u64>; 3];
+
+/// Inverted tag index of an archive, mapping tag keys to entity indices.
+///
+/// Only available for archives converted with `--tag-index`; `open` returns
+/// `NotFound` otherwise.
+#[derive(Debug)]
+pub struct TagKeyIndex {
+    data: Mmap,
+    num_keys: usize,
+}
+
+/// Sorted entity indices of one tag key.
+#[derive(Debug, Clone, Copy)]
+pub struct TagKeyEntities<'a> {
+    nodes: &'a [u8],
+    ways: &'a [u8],
+    relations: &'a [u8],
+}
+
+fn iter_u64(data: &[u8]) -> impl Iterator<Item = u64> + '_ {
+    data.chunks_exact(8)
+        .map(|entry| u64::from_le_bytes(entry.try_into().unwrap()))
+}
+
+impl<'a> TagKeyEntities<'a> {
+    /// Sorted indices of the nodes carrying the key.
+    pub fn nodes(&self) -> impl Iterator<Item = u64> + 'a {
+        iter_u64(self.nodes)
+    }
+
+    /// Sorted indices of the ways carrying the key.
+    pub fn ways(&self) -> impl Iterator<Item = u64> + 'a {
+        iter_u64(self.ways)
+    }
+
+    /// Sorted indices of the relations carrying the key.
+    pub fn relations(&self) -> impl Iterator<Item = u64> + 'a {
+        iter_u64(self.relations)
+    }
+}
+
+impl TagKeyIndex {
+    /// Opens the tag index of the archive at `archive_dir`.
+    pub fn open(archive_dir: &Path) -> io::Result<Self> {
+        let file = fs::File::open(archive_dir.join(TAG_INDEX_FILE_NAME))?;
+        let data = unsafe { Mmap::map(&file)? };
+        let invalid = |msg| io::Error::new(io::ErrorKind::InvalidData, msg);
+        if data.len() < HEADER_LEN || &data[..MAGIC.len()] != MAGIC {
+            return Err(invalid("invalid tag index magic"));
+        }
+        let num_keys =
+            u64::from_le_bytes(data[MAGIC.len()..HEADER_LEN].try_into().unwrap()) as usize;
+        if data.len() < HEADER_LEN + (num_keys + 1) * DIR_ENTRY_LEN {
+            return Err(invalid("truncated tag index"));
+        }
+        Ok(Self { data, num_keys })
+    }
+
+    /// Number of distinct tag keys in the index.
+    pub fn num_keys(&self) -> usize {
+        self.num_keys
+    }
+
+    /// Directory entry `i`: key offset and the three run starts, in payload
+    /// elements; the ends are the next entry's first run start.
+    fn dir_entry(&self, i: usize) -> (u64, [u64; 3]) {
+        let entry = &self.data[HEADER_LEN + i * DIR_ENTRY_LEN..][..DIR_ENTRY_LEN];
+        let field = |j: usize| u64::from_le_bytes(entry[j * 8..][..8].try_into().unwrap());
+        (field(0), [field(1), field(2), field(3)])
+    }
+
+    /// Looks up the entities carrying the key stored at the given
+    /// `stringtable` offset.
+    pub fn lookup(&self, key_offset: u64) -> Option<TagKeyEntities<'_>> {
+        let mut lo = 0;
+        let mut hi = self.num_keys;
+        while lo < hi {
+            let mid = lo + (hi - lo) / 2;
+            let (mid_key, _) = self.dir_entry(mid);
+            if mid_key < key_offset {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        let (key, starts) = self.dir_entry(lo);
+        if lo == self.num_keys || key != key_offset {
+            return None;
+        }
+        let (_, next) = self.dir_entry(lo + 1);
+        let payload = &self.data[HEADER_LEN + (self.num_keys + 1) * DIR_ENTRY_LEN..];
+        let run = |from: u64, to: u64| &payload[from as usize * 8..to as usize * 8];
+        Some(TagKeyEntities {
+            nodes: run(starts[0], starts[1]),
+            ways: run(starts[1], starts[2]),
+            relations: run(starts[2], next[0]),
+        })
+    }
+
+    /// Looks up the entities carrying the given key text.
+    ///
+    /// Scans the index's keys linearly and compares them against the
+    /// archive's stringtable; the number of distinct keys is small compared
+    /// to the number of entities.
+    pub fn lookup_key(&self, archive: &Osm, key: &[u8]) -> Option<TagKeyEntities<'_>> {
+        let strings = archive.stringtable();
+        (0..self.num_keys)
+            .map(|i| self.dir_entry(i).0)
+            .find(|&offset| strings.substring_raw(offset as usize) == key)
+            .and_then(|offset| self.lookup(offset))
+    }
+}
+
+/// Serializes an index map into the tag index format.
+fn write_index(index: &BTreeMap<u64, IndexedEntities>, out: &mut impl Write) -> io::Result<()> {
+    out.write_all(MAGIC)?;
+    out.write_all(&(index.len() as u64).to_le_bytes())?;
+
+    let mut element = 0_u64;
+    for (key_offset, runs) in index {
+        out.write_all(&key_offset.to_le_bytes())?;
+        for run in runs {
+            out.write_all(&element.to_le_bytes())?;
+            element += run.len() as u64;
+        }
+    }
+    // sentinel entry closing the last key's runs
+    out.write_all(&u64::max_value().to_le_bytes())?;
+    for _ in 0..3 {
+        out.write_all(&element.to_le_bytes())?;
+    }
+
+    for runs in index.values() {
+        for run in runs {
+            for entity_idx in run {
+                out.write_all(&entity_idx.to_le_bytes())?;
+            }
+        }
+    }
+    Ok(())
+}
+
+/// Builds the inverted tag index of `archive` and writes it into the archive
+/// at `archive_dir`.
+///
+/// One post-pass over all tag ranges; the index is buffered in memory before
+/// it is written.
+pub fn write_tag_index(archive: &Osm, archive_dir: &Path) -> io::Result<()> {
+    let tags = archive.tags();
+    let tags_index = archive.tags_index();
+    let mut index: BTreeMap<u64, IndexedEntities> = BTreeMap::new();
+
+    let mut add_entities = |entity_type: usize, tag_ranges: &mut dyn Iterator<Item = _>| {
+        for (entity_idx, range) in tag_ranges {
+            for tag_idx in range {
+                let key = tags[tags_index[tag_idx as usize].value() as usize].key_idx();
+                let run = &mut index.entry(key).or_default()[entity_type];
+                // an entity repeating a key is indexed once
+                if run.last() != Some(&entity_idx) {
+                    run.push(entity_idx);
+                }
+            }
+        }
+    };
+    add_entities(
+        0,
+        &mut archive
+            .nodes()
+            .iter()
+            .enumerate()
+            .map(|(i, node)| (i as u64, node.tags())),
+    );
+    add_entities(
+        1,
+        &mut archive
+            .ways()
+            .iter()
+            .enumerate()
+            .map(|(i, way)| (i as u64, way.tags())),
+    );
+    add_entities(
+        2,
+        &mut archive
+            .relations()
+            .iter()
+            .enumerate()
+            .map(|(i, relation)| (i as u64, relation.tags())),
+    );
+
+    let file = fs::File::create(archive_dir.join(TAG_INDEX_FILE_NAME))?;
+    let mut writer = BufWriter::new(file);
+    write_index(&index, &mut writer)?;
+    writer.flush()
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    #[test]
+    fn test_write_and_lookup_roundtrip() {
+        let mut index: BTreeMap<u64, IndexedEntities> = BTreeMap::new();
+        index.insert(0, [vec![1, 2, 5], vec![], vec![7]]);
+        index.insert(8, [vec![], vec![0, 3], vec![]]);
+
+        let dir = tempfile::tempdir().unwrap();
+        let file = fs::File::create(dir.path().join(TAG_INDEX_FILE_NAME)).unwrap();
+        let mut writer = BufWriter::new(file);
+        write_index(&index, &mut writer).unwrap();
+        writer.flush().unwrap();
+
+        let index = TagKeyIndex::open(dir.path()).unwrap();
+        assert_eq!(index.num_keys(), 2);
+
+        let entities = index.lookup(0).unwrap();
+        assert_eq!(entities.nodes().collect::<Vec<_>>(), vec![1, 2, 5]);
+        assert_eq!(entities.ways().count(), 0);
+        assert_eq!(entities.relations().collect::<Vec<_>>(), vec![7]);
+
+        let entities = index.lookup(8).unwrap();
+        assert_eq!(entities.nodes().count(), 0);
+        assert_eq!(entities.ways().collect::<Vec<_>>(), vec![0, 3]);
+
+        assert!(index.lookup(4).is_none());
+        assert!(index.lookup(100).is_none());
+    }
+}
@@ -0,0 +1,192 @@
+//! Benchmarks of the conversion hot primitives.
+//!
+//! Plain `harness = false` targets with a minimal `Instant` based runner, so
+//! the suite adds no dependencies. Run with `cargo bench -p osmflatc` and
+//! compare the printed ns/iter numbers before and after a change.
+
+use flate2::write::ZlibEncoder;
+use flate2::Compression;
+use prost::Message;
+
+use std::hint::black_box;
+use std::io::Write;
+use std::time::{Duration, Instant};
+
+#[allow(dead_code, unused_imports)]
+#[path = "../src/fileio.rs"]
+mod fileio;
+#[allow(dead_code, unused_imports)]
+#[path = "../src/ids.rs"]
+mod ids;
+#[allow(dead_code, unused_imports)]
+#[path = "../src/osmpbf.rs"]
+mod osmpbf;
+#[allow(dead_code, unused_imports)]
+#[path = "../src/strings.rs"]
+mod strings;
+
+/// Runs `f` repeatedly until the measurement is long enough to be stable and
+/// prints the time per iteration.
+fn bench(name: &str, mut f: impl FnMut()) {
+    f(); // warmup
+    let mut iters: u32 = 1;
+    let elapsed = loop {
+        let start = Instant::now();
+        for _ in 0..iters {
+            f();
+        }
+        let elapsed = start.elapsed();
+        if elapsed >= Duration::from_millis(200) {
+            break elapsed;
+        }
+        iters = iters.saturating_mul(2);
+    };
+    println!(
+        "{:<40} {:>12.1} ns/iter ({} iters)",
+        name,
+        elapsed.as_nanos() as f64 / f64::from(iters),
+        iters
+    );
+}
+
+fn pseudo_random(state: &mut u64) -> u64 {
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    *state
+}
+
+/// Mostly increasing ids with random small gaps, like real OSM ids.
+fn realistic_ids(n: usize) -> Vec<u64> {
+    let mut state = 0x2545_f491_4f6c_dd1d;
+    let mut id = 0;
+    (0..n)
+        .map(|_| {
+            id += 1 + pseudo_random(&mut state) % 8;
+            id
+        })
+        .collect()
+}
+
+fn bench_id_table() {
+    let ids = realistic_ids(1_000_000);
+
+    bench("idtable/insert_and_build 1M ids", || {
+        let mut builder = ids::IdTableBuilder::new();
+        for &id in &ids {
+            builder.insert(id);
+        }
+        black_box(builder.build());
+    });
+
+    let mut builder = ids::IdTableBuilder::new();
+    for &id in &ids {
+        builder.insert(id);
+    }
+    let table = builder.build();
+    let mut state = 1;
+    let queries: Vec<u64> = (0..1024)
+        .map(|_| ids[(pseudo_random(&mut state) % ids.len() as u64) as usize])
+        .collect();
+
+    bench("idtable/get 1024 random ids", || {
+        for &id in &queries {
+            black_box(table.get(id));
+        }
+    });
+
+    bench("idtable/get_many 1024 random ids", || {
+        black_box(table.get_many(&queries));
+    });
+}
+
+fn bench_string_table() {
+    // zipf-ish reuse: a small set of hot strings covers most inserts
+    let mut state = 7;
+    let inputs: Vec<String> = (0..10_000)
+        .map(|_| format!("string{}", pseudo_random(&mut state) % 1000))
+        .collect();
+
+    let table = strings::StringTable::new().unwrap();
+    bench("stringtable/insert 10k mostly-hot strings", || {
+        for input in &inputs {
+            black_box(table.insert(input));
+        }
+    });
+}
+
+/// Encodes a dense nodes PrimitiveBlock into a zlib OSMData blob with the
+/// pbf framing expected by the block index.
+fn frame_osmdata_blob(block: &osmpbf::PrimitiveBlock) -> Vec<u8> {
+    let mut payload = Vec::new();
+    block.encode(&mut payload).unwrap();
+
+    let mut encoder = ZlibEncoder::new(Vec::new(), Compression::default());
+    encoder.write_all(&payload).unwrap();
+    let blob = osmpbf::Blob {
+        raw_size: Some(payload.len() as i32),
+        zlib_data: Some(encoder.finish().unwrap()),
+        ..Default::default()
+    };
+    let mut blob_bytes = Vec::new();
+    blob.encode(&mut blob_bytes).unwrap();
+
+    let header = osmpbf::BlobHeader {
+        r#type: "OSMData".into(),
+        indexdata: None,
+        datasize: blob_bytes.len() as i32,
+    };
+    let mut header_bytes = Vec::new();
+    header.encode(&mut header_bytes).unwrap();
+
+    let mut framed = Vec::new();
+    framed.extend_from_slice(&(header_bytes.len() as u32).to_be_bytes());
+    framed.extend_from_slice(&header_bytes);
+    framed.extend_from_slice(&blob_bytes);
+    framed
+}
+
+fn dense_nodes_block(num_nodes: usize) -> osmpbf::PrimitiveBlock {
+    let mut state = 42;
+    let mut dense = osmpbf::DenseNodes::default();
+    for _ in 0..num_nodes {
+        dense.id.push(1 + pseudo_random(&mut state) as i64 % 8);
+        dense.lat.push(pseudo_random(&mut state) as i64 % 1000);
+        dense.lon.push(pseudo_random(&mut state) as i64 % 1000);
+        dense.keys_vals.push(0);
+    }
+    osmpbf::PrimitiveBlock {
+        stringtable: osmpbf::StringTable { s: vec![b"".to_vec()] },
+        primitivegroup: vec![osmpbf::PrimitiveGroup {
+            dense: Some(dense),
+            ..Default::default()
+        }],
+        ..Default::default()
+    }
+}
+
+fn bench_pbf() {
+    let block = dense_nodes_block(8000);
+    let mut data = Vec::new();
+    for _ in 0..16 {
+        data.extend_from_slice(&frame_osmdata_blob(&block));
+    }
+
+    bench("pbf/build_block_index 16 blocks", || {
+        black_box(osmpbf::build_block_index(&data));
+    });
+
+    let index = osmpbf::build_block_index(&data);
+    let pool = osmpbf::BufferPool::new();
+    bench("pbf/read_block 8k dense nodes", || {
+        let block: osmpbf::PrimitiveBlock =
+            osmpbf::read_block(&data, &index[0], &pool).unwrap();
+        black_box(block);
+    });
+}
+
+fn main() {
+    bench_id_table();
+    bench_string_table();
+    bench_pbf();
+}
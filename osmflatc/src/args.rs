@@ -9,11 +9,71 @@ pub struct Args {
     #[structopt(short, long, parse(from_occurrences))]
     pub verbose: u8,
 
-    /// Input OSM pbf file
+    /// Input OSM pbf file, or `-` to stream from stdin
     #[structopt(name = "input", parse(from_os_str))]
-    pub input: PathBuf,
+    pub input: Option<PathBuf>,
 
     /// Output directory for OSM flatdata archive
     #[structopt(name = "output", parse(from_os_str))]
+    pub output: Option<PathBuf>,
+
+    /// Write a JSON report with per-stage timings and resource usage to the
+    /// given file
+    #[structopt(long = "timings", parse(from_os_str))]
+    pub timings: Option<PathBuf>,
+
+    /// Sort nodes along a Hilbert curve and write a spatial grid index
+    /// (buffers all nodes in memory)
+    #[structopt(long = "hilbert-sort")]
+    pub hilbert_sort: bool,
+
+    /// Compute the bounding box of every way and write them as an extra
+    /// resource for spatial culling
+    #[structopt(long = "way-bboxes")]
+    pub way_bboxes: bool,
+
+    /// Build an inverted index from tag keys to entity indices and write it
+    /// as an extra resource
+    #[structopt(long = "tag-index")]
+    pub tag_index: bool,
+
+    /// Build a perfect-hash dictionary of tag keys and write it as an extra
+    /// resource for reader-side key resolution
+    #[structopt(long = "key-dict")]
+    pub key_dict: bool,
+
+    /// Resolve the geometry of every way and write it as an extra
+    /// delta-encoded resource
+    #[structopt(long = "way-geometries")]
+    pub way_geometries: bool,
+
+    /// Reorder tags and strings by descending reference frequency, so the
+    /// hottest ones stay cache-resident during scans
+    #[structopt(long = "sort-tags-by-frequency")]
+    pub sort_tags_by_frequency: bool,
+
+    #[structopt(subcommand)]
+    pub cmd: Option<Command>,
+}
+
+#[derive(Debug, StructOpt)]
+pub enum Command {
+    /// Applies an osmosis change file (.osc) to an existing archive
+    #[structopt(name = "update")]
+    Update(UpdateArgs),
+}
+
+#[derive(Debug, StructOpt)]
+pub struct UpdateArgs {
+    /// Existing osmflat archive directory
+    #[structopt(name = "archive", parse(from_os_str))]
+    pub archive: PathBuf,
+
+    /// Change file (.osc or .osc.gz)
+    #[structopt(name = "osc", parse(from_os_str))]
+    pub osc: PathBuf,
+
+    /// Output directory for the updated archive
+    #[structopt(name = "output", parse(from_os_str))]
     pub output: PathBuf,
 }
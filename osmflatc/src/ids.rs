@@ -1,11 +1,81 @@
 use rayon::prelude::*;
 
+/// Representation of one id bucket (all ids with the same value of x / 2^24).
+///
+/// OSM ids are overwhelmingly dense ascending runs, which after sorting
+/// become runs of consecutive (id, index) entries. Buckets dominated by such
+/// runs are compressed to one entry per run; genuinely sparse buckets keep
+/// the plain sorted array.
+#[derive(Debug)]
+enum Bucket {
+    /// Sorted packed (u24 id, u40 index) entries.
+    Sorted(Vec<u64>),
+    /// Sorted (packed run start, run length) entries; a run covers `len`
+    /// consecutive ids mapped to consecutive indices.
+    Ranges(Vec<(u64, u32)>),
+}
+
+impl Bucket {
+    fn from_sorted(entries: Vec<u64>) -> Bucket {
+        let mut num_runs = 1;
+        for w in entries.windows(2) {
+            if w[1] != w[0] + pack_index((1, 1)) {
+                num_runs += 1;
+            }
+        }
+        // a range entry is twice the size of a plain one
+        if entries.is_empty() || num_runs * 2 > entries.len() {
+            return Bucket::Sorted(entries);
+        }
+
+        let mut ranges = Vec::with_capacity(num_runs);
+        let mut iter = entries.into_iter();
+        let mut start = iter.next().unwrap();
+        let mut len: u32 = 1;
+        for entry in iter {
+            if entry == start + u64::from(len) * pack_index((1, 1)) {
+                len += 1;
+            } else {
+                ranges.push((start, len));
+                start = entry;
+                len = 1;
+            }
+        }
+        ranges.push((start, len));
+        Bucket::Ranges(ranges)
+    }
+
+    fn get(&self, key: u32) -> Option<u64> {
+        match self {
+            Bucket::Sorted(entries) => entries
+                .binary_search_by_key(&key, |item| unpack_packed_index(*item).0)
+                .ok()
+                .map(|pos| unpack_packed_index(entries[pos]).1),
+            Bucket::Ranges(ranges) => {
+                let pos = match ranges.binary_search_by_key(&key, |(start, _)| {
+                    unpack_packed_index(*start).0
+                }) {
+                    Ok(pos) => pos,
+                    Err(0) => return None,
+                    Err(pos) => pos - 1,
+                };
+                let (start_key, start_idx) = unpack_packed_index(ranges[pos].0);
+                let offset = key - start_key;
+                if offset < ranges[pos].1 {
+                    Some(start_idx + u64::from(offset))
+                } else {
+                    None
+                }
+            }
+        }
+    }
+}
+
 /// Maps u64 integers to a consecutive range of ids
 #[derive(Debug)]
 pub struct IdTable {
-    // map u64 id x to u32 by storing a sorted mapping table for each value of x / 2^24
-    // each mapping entry (u64) represents (u24) id set (x % 2^24), and mapped id (u40)
-    data: Vec<Vec<u64>>,
+    // map u64 id x to u32 by storing a mapping table for each value of x / 2^24
+    data: Vec<Bucket>,
     num_ids: u64,
 }
 
@@ -44,11 +114,18 @@ impl IdTableBuilder {
         result
     }
 
-    pub fn build(mut self) -> IdTable {
-        self.data.par_iter_mut().for_each(|x| x.par_sort_unstable());
+    pub fn build(self) -> IdTable {
+        let data = self
+            .data
+            .into_par_iter()
+            .map(|mut entries| {
+                entries.par_sort_unstable();
+                Bucket::from_sorted(entries)
+            })
+            .collect();
 
         IdTable {
-            data: self.data,
+            data,
             num_ids: self.next_id,
         }
     }
@@ -57,15 +134,58 @@ impl IdTableBuilder {
 impl IdTable {
     pub fn get(&self, x: u64) -> Option<u64> {
         let id_set = (x >> 24) as usize;
-        if id_set > self.data.len() {
+        if id_set >= self.data.len() {
             return None;
         }
-        self.data[id_set]
-            .binary_search_by_key(&((x % (1u64 << 24)) as u32), |item| {
-                unpack_packed_index(*item).0
-            })
-            .ok()
-            .map(|pos| unpack_packed_index(self.data[id_set][pos]).1)
+        self.data[id_set].get((x % (1u64 << 24)) as u32)
+    }
+
+    /// Looks up a batch of ids at once.
+    ///
+    /// Equivalent to calling [`get`] per id, but the queries are processed in
+    /// sorted order — grouping them by bucket and keeping consecutive
+    /// searches within the same cache lines — and the bucket of an upcoming
+    /// query is prefetched while the current one is searched. For the random
+    /// access pattern of way resolution this trades one sort of the batch for
+    /// much better cache behavior of billions of lookups.
+    ///
+    /// [`get`]: #method.get
+    pub fn get_many(&self, ids: &[u64]) -> Vec<Option<u64>> {
+        /// Distance in queries at which buckets are prefetched.
+        const PREFETCH_AHEAD: usize = 8;
+
+        let mut order: Vec<u32> = (0..ids.len() as u32).collect();
+        order.sort_unstable_by_key(|&pos| ids[pos as usize]);
+
+        let mut result = vec![None; ids.len()];
+        for (i, &pos) in order.iter().enumerate() {
+            if let Some(&ahead) = order.get(i + PREFETCH_AHEAD) {
+                self.prefetch(ids[ahead as usize]);
+            }
+            result[pos as usize] = self.get(ids[pos as usize]);
+        }
+        result
+    }
+
+    /// Hints the CPU to fetch the first probe location for id `x`.
+    #[inline]
+    fn prefetch(&self, x: u64) {
+        #[cfg(target_arch = "x86_64")]
+        {
+            let id_set = (x >> 24) as usize;
+            if let Some(bucket) = self.data.get(id_set) {
+                // prefetch the midpoint, where the binary search starts
+                let addr = match bucket {
+                    Bucket::Sorted(entries) => entries[entries.len() / 2..].as_ptr() as *const i8,
+                    Bucket::Ranges(ranges) => ranges[ranges.len() / 2..].as_ptr() as *const i8,
+                };
+                unsafe {
+                    std::arch::x86_64::_mm_prefetch(addr, std::arch::x86_64::_MM_HINT_T0);
+                }
+            }
+        }
+        #[cfg(not(target_arch = "x86_64"))]
+        let _ = x;
     }
 }
 
@@ -113,6 +233,60 @@ mod test {
         }
     }
 
+    #[test]
+    fn test_mapping_of_dense_runs() {
+        let mut builder = IdTableBuilder::new();
+        // two dense runs with a gap, plus a few stragglers
+        let data: Vec<u64> = (100..1100)
+            .chain(2000..3000)
+            .chain([5, 4000, 1_u64 << 26].iter().cloned())
+            .collect();
+        for x in &data {
+            builder.insert(*x);
+        }
+
+        let lookup = builder.build();
+        for (pos, x) in data.iter().enumerate() {
+            assert_eq!(lookup.get(*x), Some(pos as u64));
+        }
+
+        for x in [0, 99, 1100, 1999, 3000, 3999, 4001, (1_u64 << 26) + 1].iter() {
+            assert_eq!(lookup.get(*x), None);
+        }
+    }
+
+    #[test]
+    fn test_runs_crossing_bucket_boundary() {
+        let mut builder = IdTableBuilder::new();
+        let data: Vec<u64> = ((1_u64 << 24) - 100..(1_u64 << 24) + 100).collect();
+        for x in &data {
+            builder.insert(*x);
+        }
+
+        let lookup = builder.build();
+        for (pos, x) in data.iter().enumerate() {
+            assert_eq!(lookup.get(*x), Some(pos as u64));
+        }
+        assert_eq!(lookup.get((1_u64 << 24) - 101), None);
+        assert_eq!(lookup.get((1_u64 << 24) + 100), None);
+    }
+
+    #[test]
+    fn test_get_many_matches_get() {
+        let mut builder = IdTableBuilder::new();
+        let data: Vec<u64> = (100..200).chain([7, 1_u64 << 30, 42].iter().cloned()).collect();
+        for x in &data {
+            builder.insert(*x);
+        }
+        let lookup = builder.build();
+
+        let queries: Vec<u64> = (0..300).map(|x| x * 7 % 250).chain(data.clone()).collect();
+        let batched = lookup.get_many(&queries);
+        for (x, res) in queries.iter().zip(batched) {
+            assert_eq!(res, lookup.get(*x));
+        }
+    }
+
     #[test]
     fn test_large_indices() {
         let mut builder = IdTableBuilder::new();
@@ -1,12 +1,16 @@
 mod args;
+mod fileio;
 mod ids;
 mod osmpbf;
 mod parallel;
 mod stats;
 mod strings;
+mod tags;
+mod tagsort;
+mod update;
 
-use crate::osmpbf::{build_block_index, read_block, BlockIndex, BlockType};
-use crate::stats::Stats;
+use crate::osmpbf::{build_block_index, read_block, BlockIndex, BlockType, BufferPool};
+use crate::stats::{Stats, Timings};
 use crate::strings::StringTable;
 
 use colored::*;
@@ -15,19 +19,23 @@ use itertools::Itertools;
 use log::info;
 use memmap::Mmap;
 use pbr::ProgressBar;
+use rayon::prelude::*;
 use structopt::StructOpt;
 
-use std::collections::{hash_map, HashMap};
 use std::fs::File;
 use std::io;
+use std::path::Path;
 use std::str;
 
 type Error = Box<dyn std::error::Error>;
 
+#[global_allocator]
+static ALLOCATOR: stats::CountingAllocator = stats::CountingAllocator;
+
 fn serialize_header(
     header_block: &osmpbf::HeaderBlock,
     builder: &osmflat::OsmBuilder,
-    stringtable: &mut StringTable,
+    stringtable: &StringTable,
 ) -> io::Result<()> {
     let mut header = osmflat::Header::new();
 
@@ -79,7 +87,7 @@ fn serialize_header(
 struct TagSerializer<'a> {
     tags: flatdata::ExternalVector<'a, osmflat::Tag>,
     tags_index: flatdata::ExternalVector<'a, osmflat::TagIndex>,
-    dedup: HashMap<(u64, u64), u64>, // deduplication table: (key_idx, val_idx) -> pos
+    dedup: tags::TagDedup, // deduplication table: (key_idx, val_idx) -> pos
 }
 
 impl<'a> TagSerializer<'a> {
@@ -87,22 +95,21 @@ impl<'a> TagSerializer<'a> {
         Ok(Self {
             tags: builder.start_tags()?,
             tags_index: builder.start_tags_index()?,
-            dedup: HashMap::new(),
+            dedup: tags::TagDedup::new()?,
         })
     }
 
     fn serialize(&mut self, key_idx: u64, val_idx: u64) -> Result<(), Error> {
-        let idx = match self.dedup.entry((key_idx, val_idx)) {
-            hash_map::Entry::Occupied(entry) => *entry.get(),
-            hash_map::Entry::Vacant(entry) => {
-                let idx = self.tags.len() as u64;
-                let tag = self.tags.grow()?;
+        let tags = &mut self.tags;
+        let idx = self
+            .dedup
+            .get_or_insert(tags::pack_pair(key_idx, val_idx), || {
+                let idx = tags.len() as u64;
+                let tag = tags.grow()?;
                 tag.set_key_idx(key_idx);
                 tag.set_value_idx(val_idx);
-                entry.insert(idx);
-                idx
-            }
-        };
+                Ok(idx)
+            })?;
 
         let tag_index = self.tags_index.grow()?;
         tag_index.set_value(idx);
@@ -128,106 +135,144 @@ impl<'a> TagSerializer<'a> {
 /// references to be used instead
 fn add_string_table(
     pbf_stringtable: &osmpbf::StringTable,
-    stringtable: &mut StringTable,
-) -> Result<Vec<u64>, Error> {
+    stringtable: &StringTable,
+) -> io::Result<Vec<u64>> {
     let mut result = Vec::with_capacity(pbf_stringtable.s.len());
     for x in &pbf_stringtable.s {
-        let string = str::from_utf8(&x)?;
+        let string = str::from_utf8(&x)
+            .map_err(|e| io::Error::new(io::ErrorKind::InvalidData, e))?;
         result.push(stringtable.insert(string));
     }
     Ok(result)
 }
 
-fn serialize_dense_nodes(
-    block: &osmpbf::PrimitiveBlock,
-    nodes: &mut flatdata::ExternalVector<osmflat::Node>,
-    nodes_id_to_idx: &mut ids::IdTableBuilder,
-    stringtable: &mut StringTable,
-    tags: &mut TagSerializer,
-) -> Result<Stats, Error> {
-    let mut stats = Stats::default();
-    let string_refs = add_string_table(&block.stringtable, stringtable)?;
-    for group in block.primitivegroup.iter() {
-        let dense_nodes = group.dense.as_ref().unwrap();
-
-        let granularity = block.granularity.unwrap_or(100);
-        let lat_offset = block.lat_offset.unwrap_or(0);
-        let lon_offset = block.lon_offset.unwrap_or(0);
-        let mut lat = 0;
-        let mut lon = 0;
-
-        let mut tags_offset = 0;
-
-        let mut id = 0;
-        for i in 0..dense_nodes.id.len() {
-            id += dense_nodes.id[i];
-
-            let index = nodes_id_to_idx.insert(id as u64);
-            assert_eq!(index as usize, nodes.len());
+/// A dense node decoded by a producer thread.
+///
+/// Tags are stored as a count of consecutive entries in the shard's `tags`
+/// vector.
+struct ShardNode {
+    id: i64,
+    lat: i64,
+    lon: i64,
+    num_tags: u32,
+}
 
-            let node = nodes.grow()?;
-            node.set_id(id);
+/// Serialized form of one dense nodes block, built by a producer thread.
+///
+/// All decoding work (delta decoding of ids and coordinates, splitting of the
+/// interleaved `keys_vals` array, interning of strings) happens in the
+/// parallel producers. The consumer only has to append the nodes and their
+/// tags to the archive.
+struct NodesShard {
+    nodes: Vec<ShardNode>,
+    /// (key, value) pairs as indices into the global stringtable.
+    tags: Vec<(u64, u64)>,
+    stats: Stats,
+}
 
-            lat += dense_nodes.lat[i];
-            lon += dense_nodes.lon[i];
-            node.set_lat(lat_offset + (i64::from(granularity) * lat));
-            node.set_lon(lon_offset + (i64::from(granularity) * lon));
+fn build_nodes_shard(
+    dense_nodes: osmpbf::DecodedDenseNodes,
+    stringtable: &StringTable,
+) -> Result<NodesShard, io::Error> {
+    let mut shard = NodesShard {
+        nodes: Vec::with_capacity(dense_nodes.ids.len()),
+        tags: Vec::new(),
+        stats: Stats::default(),
+    };
+    let string_refs = add_string_table(&dense_nodes.stringtable, stringtable)?;
+
+    // ids and coordinates are already delta decoded and scaled by the wire
+    // decoder; only the interleaved tags remain to be split per node
+    let mut tags_offset = 0;
+    for i in 0..dense_nodes.ids.len() {
+        let mut num_tags = 0;
+        if tags_offset < dense_nodes.keys_vals.len() {
+            loop {
+                let k = dense_nodes.keys_vals[tags_offset];
+                tags_offset += 1;
+
+                if k == 0 {
+                    break; // separator
+                }
 
-            if tags_offset < dense_nodes.keys_vals.len() {
-                node.set_tag_first_idx(tags.next_index());
-                loop {
-                    let k = dense_nodes.keys_vals[tags_offset];
-                    tags_offset += 1;
+                let v = dense_nodes.keys_vals[tags_offset];
+                tags_offset += 1;
 
-                    if k == 0 {
-                        break; // separator
-                    }
+                shard
+                    .tags
+                    .push((string_refs[k as usize], string_refs[v as usize]));
+                num_tags += 1;
+            }
+        }
 
-                    let v = dense_nodes.keys_vals[tags_offset];
-                    tags_offset += 1;
+        shard.nodes.push(ShardNode {
+            id: dense_nodes.ids[i],
+            lat: dense_nodes.lats[i],
+            lon: dense_nodes.lons[i],
+            num_tags,
+        });
+    }
+    assert_eq!(tags_offset, dense_nodes.keys_vals.len());
+    shard.stats.num_nodes += dense_nodes.ids.len();
+    Ok(shard)
+}
 
-                    tags.serialize(string_refs[k as usize], string_refs[v as usize])?;
-                }
-            }
+fn serialize_nodes_shard(
+    shard: NodesShard,
+    nodes: &mut flatdata::ExternalVector<osmflat::Node>,
+    nodes_id_to_idx: &mut ids::IdTableBuilder,
+    tags: &mut TagSerializer,
+) -> Result<Stats, Error> {
+    let mut shard_tags = shard.tags.into_iter();
+    for shard_node in shard.nodes {
+        let index = nodes_id_to_idx.insert(shard_node.id as u64);
+        assert_eq!(index as usize, nodes.len());
+
+        let node = nodes.grow()?;
+        node.set_id(shard_node.id);
+        node.set_lat(shard_node.lat);
+        node.set_lon(shard_node.lon);
+        node.set_tag_first_idx(tags.next_index());
+
+        for _ in 0..shard_node.num_tags {
+            let (key_idx, val_idx) = shard_tags.next().unwrap();
+            tags.serialize(key_idx, val_idx)?;
         }
-        assert_eq!(tags_offset, dense_nodes.keys_vals.len());
-        stats.num_nodes += dense_nodes.id.len();
     }
-    Ok(stats)
+    Ok(shard.stats)
 }
 
 fn resolve_ways(
     block: &osmpbf::PrimitiveBlock,
     nodes_id_to_idx: &ids::IdTable,
 ) -> (Vec<Option<u64>>, Stats) {
-    let mut result = Vec::new();
-    let mut stats = Stats::default();
+    let mut node_refs = Vec::new();
     for group in &block.primitivegroup {
         for pbf_way in &group.ways {
             let mut node_ref = 0;
             for delta in &pbf_way.refs {
                 node_ref += delta;
-                let idx = nodes_id_to_idx.get(node_ref as u64);
-                stats.num_unresolved_node_ids += idx.is_none() as usize;
-
-                result.push(idx);
+                node_refs.push(node_ref as u64);
             }
         }
     }
+
+    let result = nodes_id_to_idx.get_many(&node_refs);
+    let mut stats = Stats::default();
+    stats.num_unresolved_node_ids = result.iter().filter(|idx| idx.is_none()).count();
     (result, stats)
 }
 
 fn serialize_ways(
     block: &osmpbf::PrimitiveBlock,
+    string_refs: &[u64],
     nodes_id_to_idx: &[Option<u64>],
     ways: &mut flatdata::ExternalVector<osmflat::Way>,
     ways_id_to_idx: &mut ids::IdTableBuilder,
-    stringtable: &mut StringTable,
     tags: &mut TagSerializer,
     nodes_index: &mut flatdata::ExternalVector<osmflat::NodeIndex>,
 ) -> Result<Stats, Error> {
     let mut stats = Stats::default();
-    let string_refs = add_string_table(&block.stringtable, stringtable)?;
     let mut nodes_idx = nodes_id_to_idx.iter().cloned();
     for group in &block.primitivegroup {
         for pbf_way in &group.ways {
@@ -257,7 +302,11 @@ fn serialize_ways(
     Ok(stats)
 }
 
-fn build_relations_index<I>(data: &[u8], block_index: I) -> Result<ids::IdTable, Error>
+fn build_relations_index<I>(
+    data: &[u8],
+    block_index: I,
+    pool: &BufferPool,
+) -> Result<ids::IdTable, Error>
 where
     I: ExactSizeIterator<Item = BlockIndex> + Send + 'static,
 {
@@ -266,12 +315,15 @@ where
     pb.message("Building relations index...");
     parallel::parallel_process(
         block_index,
-        |idx| read_block(&data, &idx),
-        |block: Result<osmpbf::PrimitiveBlock, _>| -> Result<(), Error> {
-            for group in &block?.primitivegroup {
-                for relation in &group.relations {
-                    result.insert(relation.id as u64);
-                }
+        |idx| -> Result<Vec<u64>, io::Error> {
+            let blob_data = osmpbf::decompress_block(&data, &idx, pool)?;
+            let mut ids = Vec::new();
+            osmpbf::read_relation_ids(&blob_data, &mut ids)?;
+            Ok(ids)
+        },
+        |relation_ids| -> Result<(), Error> {
+            for id in relation_ids? {
+                result.insert(id);
             }
             pb.inc();
             Ok(())
@@ -281,18 +333,65 @@ where
     Ok(result.build())
 }
 
-fn serialize_relations(
+/// Resolves all relation member ids of a block against the three id tables.
+///
+/// Like `resolve_ways`, this runs in the parallel producers, so the serial
+/// consumer only consumes the aligned results. The members are resolved per
+/// table with batched lookups, in member order.
+fn resolve_relation_members(
     block: &osmpbf::PrimitiveBlock,
     nodes_id_to_idx: &ids::IdTable,
     ways_id_to_idx: &ids::IdTable,
     relations_id_to_idx: &ids::IdTable,
-    stringtable: &mut StringTable,
+) -> (Vec<Option<u64>>, Stats) {
+    let mut queries: [(Vec<u64>, Vec<u32>); 3] = Default::default();
+    let mut num_members = 0;
+    for group in &block.primitivegroup {
+        for pbf_relation in &group.relations {
+            let mut memid = 0;
+            for i in 0..pbf_relation.memids.len() {
+                memid += pbf_relation.memids[i];
+
+                let member_type = osmpbf::relation::MemberType::from_i32(pbf_relation.types[i]);
+                debug_assert!(member_type.is_some());
+                let (ids, positions) = &mut queries[member_type.unwrap() as usize];
+                ids.push(memid as u64);
+                positions.push(num_members);
+                num_members += 1;
+            }
+        }
+    }
+
+    let mut result = vec![None; num_members as usize];
+    let mut stats = Stats::default();
+    let tables = [nodes_id_to_idx, ways_id_to_idx, relations_id_to_idx];
+    let unresolved_counts = [
+        &mut stats.num_unresolved_node_ids,
+        &mut stats.num_unresolved_way_ids,
+        &mut stats.num_unresolved_rel_ids,
+    ];
+    for (((ids, positions), table), unresolved) in
+        queries.iter().zip(&tables).zip(unresolved_counts)
+    {
+        let indices = table.get_many(ids);
+        *unresolved += indices.iter().filter(|idx| idx.is_none()).count();
+        for (&position, idx) in positions.iter().zip(indices) {
+            result[position as usize] = idx;
+        }
+    }
+    (result, stats)
+}
+
+fn serialize_relations(
+    block: &osmpbf::PrimitiveBlock,
+    string_refs: &[u64],
+    member_indices: &[Option<u64>],
     relations: &mut flatdata::ExternalVector<osmflat::Relation>,
     relation_members: &mut flatdata::MultiVector<osmflat::RelationMembers>,
     tags: &mut TagSerializer,
 ) -> Result<Stats, Error> {
     let mut stats = Stats::default();
-    let string_refs = add_string_table(&block.stringtable, stringtable)?;
+    let mut member_idx = member_indices.iter().cloned();
     for group in &block.primitivegroup {
         for pbf_relation in &group.relations {
             let relation = relations.grow()?;
@@ -317,35 +416,24 @@ fn serialize_relations(
                 "invalid input data"
             );
 
-            let mut memid = 0;
             let mut members = relation_members.grow()?;
             for i in 0..pbf_relation.roles_sid.len() {
-                memid += pbf_relation.memids[i];
-
                 let member_type = osmpbf::relation::MemberType::from_i32(pbf_relation.types[i]);
                 debug_assert!(member_type.is_some());
 
+                let idx = member_idx.next().unwrap();
                 match member_type.unwrap() {
                     osmpbf::relation::MemberType::Node => {
-                        let idx = nodes_id_to_idx.get(memid as u64);
-                        stats.num_unresolved_node_ids = idx.is_none() as usize;
-
                         let member = members.add_node_member();
                         member.set_node_idx(idx);
                         member.set_role_idx(string_refs[pbf_relation.roles_sid[i] as usize]);
                     }
                     osmpbf::relation::MemberType::Way => {
-                        let idx = ways_id_to_idx.get(memid as u64);
-                        stats.num_unresolved_way_ids = idx.is_none() as usize;
-
                         let member = members.add_way_member();
                         member.set_way_idx(idx);
                         member.set_role_idx(string_refs[pbf_relation.roles_sid[i] as usize]);
                     }
                     osmpbf::relation::MemberType::Relation => {
-                        let idx = relations_id_to_idx.get(memid as u64);
-                        stats.num_unresolved_rel_ids = idx.is_none() as usize;
-
                         let member = members.add_relation_member();
                         member.set_relation_idx(idx);
                         member.set_role_idx(string_refs[pbf_relation.roles_sid[i] as usize]);
@@ -358,36 +446,122 @@ fn serialize_relations(
     Ok(stats)
 }
 
+/// Order of the Hilbert curve nodes are sorted along with `--hilbert-sort`.
+const HILBERT_SORT_ORDER: u32 = 20;
+
+/// Writes the collected nodes sorted along a Hilbert curve and builds the
+/// grid index mapping spatial cells to node ranges.
+///
+/// Since ways and relations resolve node references through the id table,
+/// they automatically pick up the new node indices; no renumbering pass is
+/// needed.
+fn serialize_hilbert_sorted_nodes(
+    mut shards: Vec<NodesShard>,
+    nodes: &mut flatdata::ExternalVector<osmflat::Node>,
+    nodes_id_to_idx: &mut ids::IdTableBuilder,
+    tags: &mut TagSerializer,
+    grid_index_dir: &Path,
+    stats: &mut Stats,
+) -> Result<(), Error> {
+    // (hilbert rank, shard, node in shard); the rank of the coarser grid index
+    // cell is a prefix of the rank, so sorting by rank also groups nodes by
+    // cell
+    let mut order = Vec::with_capacity(shards.iter().map(|s| s.nodes.len()).sum());
+    let mut tag_starts = Vec::with_capacity(shards.len());
+    for (shard_idx, shard) in shards.iter_mut().enumerate() {
+        *stats += std::mem::take(&mut shard.stats);
+        let mut tag_start = 0_u64;
+        let mut starts = Vec::with_capacity(shard.nodes.len());
+        for (node_idx, node) in shard.nodes.iter().enumerate() {
+            starts.push(tag_start);
+            tag_start += u64::from(node.num_tags);
+            let (x, y) = osmflat::hilbert::grid_coords(HILBERT_SORT_ORDER, node.lat, node.lon);
+            let rank = osmflat::hilbert::rank(HILBERT_SORT_ORDER, x, y);
+            order.push((rank, shard_idx as u32, node_idx as u32));
+        }
+        tag_starts.push(starts);
+    }
+    order.par_sort_unstable();
+
+    let mut cell_starts = vec![0_u64; osmflat::grid::GridIndex::num_cells() as usize + 1];
+    let cell_shift = 2 * (HILBERT_SORT_ORDER - osmflat::grid::CELL_ORDER);
+    for &(rank, shard_idx, node_idx) in &order {
+        let shard = &shards[shard_idx as usize];
+        let shard_node = &shard.nodes[node_idx as usize];
+        nodes_id_to_idx.insert(shard_node.id as u64);
+
+        let node = nodes.grow()?;
+        node.set_id(shard_node.id);
+        node.set_lat(shard_node.lat);
+        node.set_lon(shard_node.lon);
+        node.set_tag_first_idx(tags.next_index());
+
+        let tag_start = tag_starts[shard_idx as usize][node_idx as usize] as usize;
+        for &(key_idx, val_idx) in
+            &shard.tags[tag_start..tag_start + shard_node.num_tags as usize]
+        {
+            tags.serialize(key_idx, val_idx)?;
+        }
+
+        cell_starts[(rank >> cell_shift) as usize + 1] += 1;
+    }
+    for cell in 1..cell_starts.len() {
+        cell_starts[cell] += cell_starts[cell - 1];
+    }
+    osmflat::grid::GridIndex::new(cell_starts).write(grid_index_dir)?;
+    info!("Grid index written.");
+    Ok(())
+}
+
 fn serialize_dense_node_blocks(
     builder: &osmflat::OsmBuilder,
     blocks: Vec<BlockIndex>,
     data: &[u8],
+    pool: &BufferPool,
     tags: &mut TagSerializer,
-    stringtable: &mut StringTable,
+    stringtable: &StringTable,
     stats: &mut Stats,
+    hilbert_sort_dir: Option<&Path>,
 ) -> Result<ids::IdTable, Error> {
     let mut nodes_id_to_idx = ids::IdTableBuilder::new();
     let mut nodes = builder.start_nodes()?;
     let mut pb = ProgressBar::new(blocks.len() as u64);
     pb.message("Converting dense nodes...");
 
+    // with `--hilbert-sort` the shards are collected and written in spatial
+    // order afterwards
+    let mut sort_shards = Vec::new();
+
     parallel::parallel_process(
         blocks.into_iter(),
-        |idx| read_block(&data, &idx),
-        |block| -> Result<(), Error> {
-            *stats += serialize_dense_nodes(
-                &block?,
-                &mut nodes,
-                &mut nodes_id_to_idx,
-                stringtable,
-                tags,
-            )?;
+        |idx| -> Result<NodesShard, io::Error> {
+            let blob_data = osmpbf::decompress_block(&data, &idx, pool)?;
+            let dense_nodes = osmpbf::decode_dense_nodes(&blob_data)?;
+            build_nodes_shard(dense_nodes, stringtable)
+        },
+        |shard| -> Result<(), Error> {
+            if hilbert_sort_dir.is_some() {
+                sort_shards.push(shard?);
+            } else {
+                *stats += serialize_nodes_shard(shard?, &mut nodes, &mut nodes_id_to_idx, tags)?;
+            }
 
             pb.inc();
             Ok(())
         },
     )?;
 
+    if let Some(grid_index_dir) = hilbert_sort_dir {
+        serialize_hilbert_sorted_nodes(
+            sort_shards,
+            &mut nodes,
+            &mut nodes_id_to_idx,
+            tags,
+            grid_index_dir,
+            stats,
+        )?;
+    }
+
     // fill tag_first_idx of the sentry, since it contains the end of the tag range
     // of the last node
     nodes.grow()?.set_tag_first_idx(tags.next_index());
@@ -403,9 +577,10 @@ fn serialize_way_blocks(
     builder: &osmflat::OsmBuilder,
     blocks: Vec<BlockIndex>,
     data: &[u8],
+    pool: &BufferPool,
     nodes_id_to_idx: &ids::IdTable,
     tags: &mut TagSerializer,
-    stringtable: &mut StringTable,
+    stringtable: &StringTable,
     stats: &mut Stats,
 ) -> Result<ids::IdTable, Error> {
     let mut ways_id_to_idx = ids::IdTableBuilder::new();
@@ -416,19 +591,24 @@ fn serialize_way_blocks(
     parallel::parallel_process(
         blocks.into_iter(),
         |idx| {
-            let block: osmpbf::PrimitiveBlock = read_block(&data, &idx)?;
+            let block: osmpbf::PrimitiveBlock = read_block(&data, &idx, pool)?;
+            let string_refs = add_string_table(&block.stringtable, stringtable)?;
             let ids = resolve_ways(&block, nodes_id_to_idx);
-            Ok((block, ids))
+            Ok((block, string_refs, ids))
         },
-        |block: Result<(osmpbf::PrimitiveBlock, (Vec<Option<u64>>, Stats)), io::Error>| -> Result<(), Error> {
-            let (block, (ids, stats_resolve)) = block?;
+        |block: Result<
+            (osmpbf::PrimitiveBlock, Vec<u64>, (Vec<Option<u64>>, Stats)),
+            io::Error,
+        >|
+         -> Result<(), Error> {
+            let (block, string_refs, (ids, stats_resolve)) = block?;
             *stats += stats_resolve;
             *stats += serialize_ways(
                 &block,
+                &string_refs,
                 &ids,
                 &mut ways,
                 &mut ways_id_to_idx,
-                stringtable,
                 tags,
                 &mut nodes_index,
             )?;
@@ -456,15 +636,16 @@ fn serialize_relation_blocks(
     builder: &osmflat::OsmBuilder,
     blocks: Vec<BlockIndex>,
     data: &[u8],
+    pool: &BufferPool,
     nodes_id_to_idx: &ids::IdTable,
     ways_id_to_idx: &ids::IdTable,
     tags: &mut TagSerializer,
-    stringtable: &mut StringTable,
+    stringtable: &StringTable,
     stats: &mut Stats,
 ) -> Result<(), Error> {
     // We need to build the index of relation ids first, since relations can refer
     // again to relations.
-    let relations_id_to_idx = build_relations_index(data, blocks.clone().into_iter())?;
+    let relations_id_to_idx = build_relations_index(data, blocks.clone().into_iter(), pool)?;
 
     let mut relations = builder.start_relations()?;
     let mut relation_members = builder.start_relation_members()?;
@@ -473,14 +654,24 @@ fn serialize_relation_blocks(
     pb.message("Converting relations...");
     parallel::parallel_process(
         blocks.into_iter(),
-        |idx| read_block(&data, &idx),
+        |idx| -> Result<(osmpbf::PrimitiveBlock, Vec<u64>, (Vec<Option<u64>>, Stats)), io::Error> {
+            let block: osmpbf::PrimitiveBlock = read_block(&data, &idx, pool)?;
+            let string_refs = add_string_table(&block.stringtable, stringtable)?;
+            let members = resolve_relation_members(
+                &block,
+                nodes_id_to_idx,
+                ways_id_to_idx,
+                &relations_id_to_idx,
+            );
+            Ok((block, string_refs, members))
+        },
         |block| -> Result<(), Error> {
+            let (block, string_refs, (member_indices, member_stats)) = block?;
+            *stats += member_stats;
             *stats += serialize_relations(
-                &block?,
-                &nodes_id_to_idx,
-                &ways_id_to_idx,
-                &relations_id_to_idx,
-                stringtable,
+                &block,
+                &string_refs,
+                &member_indices,
                 &mut relations,
                 &mut relation_members,
                 tags,
@@ -504,24 +695,43 @@ fn serialize_relation_blocks(
 }
 
 fn run(args: args::Args) -> Result<(), Error> {
-    let input_file = File::open(&args.input)?;
-    let input_data = unsafe { Mmap::map(&input_file)? };
+    if let Some(args::Command::Update(update_args)) = args.cmd {
+        return update::run(&update_args);
+    }
+    let (input, output) = match (&args.input, &args.output) {
+        (Some(input), Some(output)) => (input.clone(), output.clone()),
+        _ => return Err("<input> and <output> are required".into()),
+    };
 
-    let storage = FileResourceStorage::new(args.output.clone());
+    let storage = FileResourceStorage::new(output.clone());
     let builder = osmflat::OsmBuilder::new(storage)?;
 
-    // TODO: Would be nice not store all these strings in memory, but to flush them
-    // from time to time to disk.
-    let mut stringtable = StringTable::new();
+    let stringtable = StringTable::new()?;
     let mut tags = TagSerializer::new(&builder)?;
+    let pool = BufferPool::new();
 
-    info!(
-        "Initialized new osmflat archive at: {}",
-        &args.output.display()
-    );
+    info!("Initialized new osmflat archive at: {}", output.display());
+
+    let mut timings = Timings::new();
 
     info!("Building index of PBF blocks...");
-    let block_index = build_block_index(&input_data);
+    let (input_data, block_index) =
+        timings.measure("block_index", || -> Result<(Mmap, Vec<BlockIndex>), Error> {
+            if input == Path::new("-") {
+                // Streaming mode: consume stdin into an on-disk block store,
+                // which then serves the multi-pass phases below.
+                let mut store = tempfile::tempfile()?;
+                let stdin = io::stdin();
+                let index = osmpbf::stream_into_block_store(&mut stdin.lock(), &mut store)?;
+                let data = unsafe { Mmap::map(&store)? };
+                Ok((data, index))
+            } else {
+                let input_file = File::open(&input)?;
+                let data = unsafe { Mmap::map(&input_file)? };
+                let index = build_block_index(&data);
+                Ok((data, index))
+            }
+        })?;
 
     // TODO: move out into a function
     let groups = block_index.into_iter().group_by(|b| b.block_type);
@@ -549,50 +759,119 @@ fn run(args: args::Args) -> Result<(), Error> {
         .into());
     }
     let idx = &pbf_header[0];
-    let pbf_header: osmpbf::HeaderBlock = read_block(&input_data, &idx)?;
-    serialize_header(&pbf_header, &builder, &mut stringtable)?;
+    let pbf_header: osmpbf::HeaderBlock = read_block(&input_data, &idx, &pool)?;
+    serialize_header(&pbf_header, &builder, &stringtable)?;
     info!("Header written.");
 
     let mut stats = Stats::default();
 
-    let nodes_id_to_idx = serialize_dense_node_blocks(
-        &builder,
-        pbf_dense_nodes,
-        &input_data,
-        &mut tags,
-        &mut stringtable,
-        &mut stats,
-    )?;
-
-    let ways_id_to_idx = serialize_way_blocks(
-        &builder,
-        pbf_ways,
-        &input_data,
-        &nodes_id_to_idx,
-        &mut tags,
-        &mut stringtable,
-        &mut stats,
-    )?;
-
-    serialize_relation_blocks(
-        &builder,
-        pbf_relations,
-        &input_data,
-        &nodes_id_to_idx,
-        &ways_id_to_idx,
-        &mut tags,
-        &mut stringtable,
-        &mut stats,
-    )?;
+    let hilbert_sort_dir = if args.hilbert_sort {
+        Some(output.as_path())
+    } else {
+        None
+    };
+    let nodes_id_to_idx = timings.measure("dense_nodes", || {
+        serialize_dense_node_blocks(
+            &builder,
+            pbf_dense_nodes,
+            &input_data,
+            &pool,
+            &mut tags,
+            &stringtable,
+            &mut stats,
+            hilbert_sort_dir,
+        )
+    })?;
+
+    let ways_id_to_idx = timings.measure("ways", || {
+        serialize_way_blocks(
+            &builder,
+            pbf_ways,
+            &input_data,
+            &pool,
+            &nodes_id_to_idx,
+            &mut tags,
+            &stringtable,
+            &mut stats,
+        )
+    })?;
+
+    timings.measure("relations", || {
+        serialize_relation_blocks(
+            &builder,
+            pbf_relations,
+            &input_data,
+            &pool,
+            &nodes_id_to_idx,
+            &ways_id_to_idx,
+            &mut tags,
+            &stringtable,
+            &mut stats,
+        )
+    })?;
 
     // Finalize data structures
     tags.close(); // drop the reference to stringtable
 
     info!("Writing stringtable to disk...");
-    builder.set_stringtable(&stringtable.into_bytes())?;
+    timings.measure("stringtable", || -> Result<(), Error> {
+        let stringtable_bytes = stringtable.into_bytes()?;
+        builder.set_stringtable(&stringtable_bytes)?;
+        // auxiliary sorted offsets, so readers can slice strings without
+        // scanning for the terminator
+        osmflat::strings::StringOffsets::build(&stringtable_bytes).write(&output)?;
+        Ok(())
+    })?;
+
+    if args.sort_tags_by_frequency {
+        // must run before any pass storing offsets into tags or stringtable
+        timings.measure("sort_tags", || tagsort::run(&output))?;
+        info!("Tags reordered by reference frequency.");
+    }
+
+    if args.way_bboxes {
+        timings.measure("way_bboxes", || -> Result<(), Error> {
+            let archive = osmflat::Osm::open(FileResourceStorage::new(output.clone()))?;
+            osmflat::bbox::write_way_bboxes(&archive, &output)?;
+            Ok(())
+        })?;
+        info!("Way bboxes written.");
+    }
+
+    if args.tag_index {
+        timings.measure("tag_index", || -> Result<(), Error> {
+            let archive = osmflat::Osm::open(FileResourceStorage::new(output.clone()))?;
+            osmflat::tagindex::write_tag_index(&archive, &output)?;
+            Ok(())
+        })?;
+        info!("Tag index written.");
+    }
+
+    if args.key_dict {
+        timings.measure("key_dict", || -> Result<(), Error> {
+            let archive = osmflat::Osm::open(FileResourceStorage::new(output.clone()))?;
+            osmflat::keydict::write_key_dict(&archive, &output)?;
+            Ok(())
+        })?;
+        info!("Key dictionary written.");
+    }
+
+    if args.way_geometries {
+        timings.measure("way_geometries", || -> Result<(), Error> {
+            let archive = osmflat::Osm::open(FileResourceStorage::new(output.clone()))?;
+            osmflat::geometry::write_way_geometries(&archive, &output)?;
+            Ok(())
+        })?;
+        info!("Way geometries written.");
+    }
 
     info!("osmflat archive built.");
 
+    if let Some(timings_path) = &args.timings {
+        timings.write_json(&mut File::create(timings_path)?)?;
+        info!("Timings report written to: {}", timings_path.display());
+    }
+
     println!("{}", stats);
     Ok(())
 }
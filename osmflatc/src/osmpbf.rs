@@ -1,10 +1,13 @@
 use byteorder::{ByteOrder, NetworkEndian};
 use flate2::read::ZlibDecoder;
 use log::info;
+use parking_lot::Mutex;
 use prost::{self, Message};
 use rayon::prelude::*;
 
-use std::io::{self, Cursor, Read};
+use std::io::{self, Cursor, Read, Write};
+use std::mem;
+use std::ops::Deref;
 
 include!(concat!(env!("OUT_DIR"), "/osmpbf.rs"));
 
@@ -88,9 +91,9 @@ struct BlockIndexIterator<'a> {
     cursor: usize,
 }
 
-enum BlobInfo {
+enum BlobInfo<'a> {
     Header(BlockIndex),
-    Unknown(usize, usize, Vec<u8>),
+    Unknown(usize, usize, &'a [u8]),
 }
 
 impl<'a> BlockIndexIterator<'a> {
@@ -98,13 +101,13 @@ impl<'a> BlockIndexIterator<'a> {
         Self { data, cursor: 0 }
     }
 
-    fn read(&mut self, len: usize) -> &[u8] {
+    fn read(&mut self, len: usize) -> &'a [u8] {
         let data = &self.data[self.cursor..self.cursor + len];
         self.cursor += len;
         data
     }
 
-    fn next_blob(&mut self) -> Result<BlobInfo, io::Error> {
+    fn next_blob(&mut self) -> Result<BlobInfo<'a>, io::Error> {
         // read size of blob header
         let blob_header_len: i32 = NetworkEndian::read_i32(self.read(4));
 
@@ -122,12 +125,8 @@ impl<'a> BlockIndexIterator<'a> {
                 blob_len,
             }))
         } else if blob_header.r#type == "OSMData" {
-            // read blob
-            Ok(BlobInfo::Unknown(
-                blob_start,
-                blob_len,
-                self.read(blob_header.datasize as usize).to_vec(),
-            ))
+            // borrow the blob directly from the mmap
+            Ok(BlobInfo::Unknown(blob_start, blob_len, self.read(blob_len)))
         } else {
             panic!("unknown blob type");
         }
@@ -135,7 +134,7 @@ impl<'a> BlockIndexIterator<'a> {
 }
 
 impl<'a> Iterator for BlockIndexIterator<'a> {
-    type Item = Result<BlobInfo, io::Error>;
+    type Item = Result<BlobInfo<'a>, io::Error>;
     fn next(&mut self) -> Option<Self::Item> {
         if self.cursor < self.data.len() {
             Some(self.next_blob())
@@ -145,57 +144,543 @@ impl<'a> Iterator for BlockIndexIterator<'a> {
     }
 }
 
-pub fn read_block<T: prost::Message + Default>(
+/// Reads as many bytes as fit into `buf`; returns `false` on a clean EOF
+/// before the first byte.
+fn read_exact_or_eof(input: &mut impl Read, buf: &mut [u8]) -> io::Result<bool> {
+    let mut filled = 0;
+    while filled < buf.len() {
+        let num_read = input.read(&mut buf[filled..])?;
+        if num_read == 0 {
+            if filled == 0 {
+                return Ok(false);
+            }
+            return Err(io::Error::new(
+                io::ErrorKind::UnexpectedEof,
+                "truncated pbf stream",
+            ));
+        }
+        filled += num_read;
+    }
+    Ok(true)
+}
+
+/// Consumes a PBF stream, appending every blob to the on-disk block store
+/// and indexing it on the fly.
+///
+/// The returned index points into the store, which holds the concatenated
+/// blob contents without the framing headers. Memory mapped, the store
+/// serves `read_block` exactly like a regular input file, so the multi-pass
+/// conversion phases also work for non-seekable input such as
+/// `curl ... | osmflatc -`, overlapping the transfer with indexing.
+pub fn stream_into_block_store(
+    input: &mut impl Read,
+    store: &mut std::fs::File,
+) -> io::Result<Vec<BlockIndex>> {
+    let mut writer = io::BufWriter::new(store);
+    let mut result = Vec::new();
+    let mut header_buf = Vec::new();
+    let mut blob_buf = Vec::new();
+    let mut blob_start = 0_usize;
+
+    let mut len_buf = [0_u8; 4];
+    while read_exact_or_eof(input, &mut len_buf)? {
+        let blob_header_len = NetworkEndian::read_i32(&len_buf);
+
+        header_buf.resize(blob_header_len as usize, 0);
+        input.read_exact(&mut header_buf)?;
+        let blob_header = BlobHeader::decode(&header_buf[..])?;
+
+        let blob_len = blob_header.datasize as usize;
+        blob_buf.resize(blob_len, 0);
+        input.read_exact(&mut blob_buf)?;
+        writer.write_all(&blob_buf)?;
+
+        let block = if blob_header.r#type == "OSMHeader" {
+            Ok(BlockIndex {
+                block_type: BlockType::Header,
+                blob_start,
+                blob_len,
+            })
+        } else if blob_header.r#type == "OSMData" {
+            blob_type_from_blob_info(blob_start, blob_len, &blob_buf)
+        } else {
+            panic!("unknown blob type");
+        };
+        match block {
+            Ok(block) => result.push(block),
+            Err(e) => eprintln!("Skipping block due to error: {}", e),
+        }
+        blob_start += blob_len;
+    }
+    writer.flush()?;
+
+    result.sort_unstable();
+    info!("Found {} blocks", result.len());
+    Ok(result)
+}
+
+/// Reads the length-delimited field at the cursor and returns it as a slice
+/// borrowed from `data`, advancing the cursor past it.
+fn len_delimited_slice<'a>(data: &'a [u8], cursor: &mut Cursor<&[u8]>) -> io::Result<&'a [u8]> {
+    let len = prost::encoding::decode_varint(cursor)? as usize;
+    let start = cursor.position() as usize;
+    let slice = data
+        .get(start..start + len)
+        .ok_or_else(|| io::Error::new(io::ErrorKind::InvalidData, "truncated message"))?;
+    cursor.set_position((start + len) as u64);
+    Ok(slice)
+}
+
+/// Extracts only the relation ids from a decompressed `PrimitiveBlock`.
+///
+/// The relations index pass needs nothing but the ids, so this walks the
+/// wire format directly and skips every other field — stringtable, member
+/// arrays, roles — without materializing a `PrimitiveBlock`.
+pub fn read_relation_ids(blob_data: &[u8], ids: &mut Vec<u64>) -> io::Result<()> {
+    const PRIMITIVE_GROUP_TAG: u32 = 2;
+    const RELATIONS_TAG: u32 = 4;
+    const RELATION_ID_TAG: u32 = 1;
+
+    let skip = |wire_type, key, cursor: &mut Cursor<&[u8]>| {
+        prost::encoding::skip_field(
+            wire_type,
+            key,
+            cursor,
+            prost::encoding::DecodeContext::default(),
+        )
+    };
+
+    let mut block = Cursor::new(blob_data);
+    while (block.position() as usize) < blob_data.len() {
+        let (key, wire_type) = prost::encoding::decode_key(&mut block)?;
+        if key != PRIMITIVE_GROUP_TAG || wire_type != prost::encoding::WireType::LengthDelimited {
+            skip(wire_type, key, &mut block)?;
+            continue;
+        }
+
+        let group = len_delimited_slice(blob_data, &mut block)?;
+        let mut group_cursor = Cursor::new(group);
+        while (group_cursor.position() as usize) < group.len() {
+            let (key, wire_type) = prost::encoding::decode_key(&mut group_cursor)?;
+            if key != RELATIONS_TAG || wire_type != prost::encoding::WireType::LengthDelimited {
+                skip(wire_type, key, &mut group_cursor)?;
+                continue;
+            }
+
+            let relation = len_delimited_slice(group, &mut group_cursor)?;
+            let mut relation_cursor = Cursor::new(relation);
+            while (relation_cursor.position() as usize) < relation.len() {
+                let (key, wire_type) = prost::encoding::decode_key(&mut relation_cursor)?;
+                if key == RELATION_ID_TAG && wire_type == prost::encoding::WireType::Varint {
+                    ids.push(prost::encoding::decode_varint(&mut relation_cursor)?);
+                } else {
+                    skip(wire_type, key, &mut relation_cursor)?;
+                }
+            }
+        }
+    }
+    Ok(())
+}
+
+/// Dense nodes of one `PrimitiveBlock`, decoded straight from the wire.
+///
+/// Ids and coordinates are fully resolved: deltas are accumulated and
+/// granularity and offsets are applied, so consumers index the arrays
+/// directly instead of repeating the scalar per-element work.
+#[derive(Debug, Default)]
+pub struct DecodedDenseNodes {
+    pub stringtable: StringTable,
+    pub ids: Vec<i64>,
+    /// Latitudes in nanodegrees.
+    pub lats: Vec<i64>,
+    /// Longitudes in nanodegrees.
+    pub lons: Vec<i64>,
+    /// Interleaved key/value stringtable references, `0` terminates a node.
+    pub keys_vals: Vec<i32>,
+}
+
+/// Borrowed packed arrays of one `DenseNodes` message.
+///
+/// Every array may be split over several occurrences of its field; delta
+/// accumulation continues across the split.
+#[derive(Default)]
+struct DenseSlices<'a> {
+    ids: Vec<&'a [u8]>,
+    lats: Vec<&'a [u8]>,
+    lons: Vec<&'a [u8]>,
+    keys_vals: Vec<&'a [u8]>,
+}
+
+/// Decodes a packed `sint64` array, accumulating deltas and mapping every
+/// absolute value with `map`.
+///
+/// The hot path is the single-byte varint, which covers almost all deltas of
+/// sorted ids and neighboring coordinates; only the fallback loops over
+/// continuation bytes.
+fn decode_packed_deltas(
+    data: &[u8],
+    acc: &mut i64,
+    out: &mut Vec<i64>,
+    mut map: impl FnMut(i64) -> i64,
+) -> io::Result<()> {
+    let mut pos = 0;
+    while pos < data.len() {
+        let byte = data[pos];
+        pos += 1;
+        let mut raw = u64::from(byte & 0x7f);
+        if byte >= 0x80 {
+            let mut shift = 7;
+            loop {
+                // a varint is at most 10 bytes; cap the shift like
+                // prost::encoding::decode_varint does
+                if shift > 63 {
+                    return Err(io::Error::new(
+                        io::ErrorKind::InvalidData,
+                        "invalid varint in packed array",
+                    ));
+                }
+                let byte = *data.get(pos).ok_or_else(|| {
+                    io::Error::new(io::ErrorKind::InvalidData, "truncated packed array")
+                })?;
+                pos += 1;
+                raw |= u64::from(byte & 0x7f) << shift;
+                if byte < 0x80 {
+                    break;
+                }
+                shift += 7;
+            }
+        }
+        let delta = ((raw >> 1) as i64) ^ -((raw & 1) as i64);
+        *acc += delta;
+        out.push(map(*acc));
+    }
+    Ok(())
+}
+
+/// Decodes a packed `int32` array.
+fn decode_packed_i32(data: &[u8], out: &mut Vec<i32>) -> io::Result<()> {
+    let mut cursor = Cursor::new(data);
+    while (cursor.position() as usize) < data.len() {
+        out.push(prost::encoding::decode_varint(&mut cursor)? as i32);
+    }
+    Ok(())
+}
+
+/// Decodes the dense nodes of a decompressed `PrimitiveBlock` directly from
+/// the wire bytes.
+///
+/// The generic prost decode materializes the raw delta arrays as `Vec<i64>`,
+/// which the conversion then re-walks element by element to apply deltas,
+/// granularity and offsets. Dense nodes dominate planet blocks, so this
+/// fuses varint decoding, zigzag, prefix-sum accumulation and granularity
+/// scaling into one pass over the wire bytes and skips all fields the
+/// conversion never looks at (e.g. `DenseInfo`).
+pub fn decode_dense_nodes(blob_data: &[u8]) -> io::Result<DecodedDenseNodes> {
+    const STRINGTABLE_TAG: u32 = 1;
+    const PRIMITIVE_GROUP_TAG: u32 = 2;
+    const GRANULARITY_TAG: u32 = 17;
+    const LAT_OFFSET_TAG: u32 = 19;
+    const LON_OFFSET_TAG: u32 = 20;
+    const DENSE_TAG: u32 = 2;
+    const ID_TAG: u32 = 1;
+    const LAT_TAG: u32 = 8;
+    const LON_TAG: u32 = 9;
+    const KEYS_VALS_TAG: u32 = 10;
+
+    let skip = |wire_type, key, cursor: &mut Cursor<&[u8]>| {
+        prost::encoding::skip_field(
+            wire_type,
+            key,
+            cursor,
+            prost::encoding::DecodeContext::default(),
+        )
+    };
+    let packed = |wire_type| {
+        if wire_type == prost::encoding::WireType::LengthDelimited {
+            Ok(())
+        } else {
+            Err(io::Error::new(
+                io::ErrorKind::InvalidData,
+                "unsupported non-packed dense nodes array",
+            ))
+        }
+    };
+
+    // first pass: locate the packed arrays; granularity and offsets may
+    // follow the groups on the wire, so decoding has to wait for them
+    let mut result = DecodedDenseNodes::default();
+    let mut dense_messages = Vec::new();
+    let mut granularity: i64 = 100;
+    let mut lat_offset: i64 = 0;
+    let mut lon_offset: i64 = 0;
+
+    let mut block = Cursor::new(blob_data);
+    while (block.position() as usize) < blob_data.len() {
+        let (key, wire_type) = prost::encoding::decode_key(&mut block)?;
+        match key {
+            STRINGTABLE_TAG => {
+                result.stringtable = StringTable::decode(len_delimited_slice(blob_data, &mut block)?)?;
+            }
+            PRIMITIVE_GROUP_TAG => {
+                let group = len_delimited_slice(blob_data, &mut block)?;
+                let mut group_cursor = Cursor::new(group);
+                while (group_cursor.position() as usize) < group.len() {
+                    let (key, wire_type) = prost::encoding::decode_key(&mut group_cursor)?;
+                    if key != DENSE_TAG {
+                        skip(wire_type, key, &mut group_cursor)?;
+                        continue;
+                    }
+                    let dense = len_delimited_slice(group, &mut group_cursor)?;
+                    let mut slices = DenseSlices::default();
+                    let mut dense_cursor = Cursor::new(dense);
+                    while (dense_cursor.position() as usize) < dense.len() {
+                        let (key, wire_type) = prost::encoding::decode_key(&mut dense_cursor)?;
+                        match key {
+                            ID_TAG => {
+                                packed(wire_type)?;
+                                slices.ids.push(len_delimited_slice(dense, &mut dense_cursor)?);
+                            }
+                            LAT_TAG => {
+                                packed(wire_type)?;
+                                slices.lats.push(len_delimited_slice(dense, &mut dense_cursor)?);
+                            }
+                            LON_TAG => {
+                                packed(wire_type)?;
+                                slices.lons.push(len_delimited_slice(dense, &mut dense_cursor)?);
+                            }
+                            KEYS_VALS_TAG => {
+                                packed(wire_type)?;
+                                slices
+                                    .keys_vals
+                                    .push(len_delimited_slice(dense, &mut dense_cursor)?);
+                            }
+                            _ => skip(wire_type, key, &mut dense_cursor)?,
+                        }
+                    }
+                    dense_messages.push(slices);
+                }
+            }
+            GRANULARITY_TAG => {
+                granularity = prost::encoding::decode_varint(&mut block)? as i32 as i64;
+            }
+            LAT_OFFSET_TAG => {
+                lat_offset = prost::encoding::decode_varint(&mut block)? as i64;
+            }
+            LON_OFFSET_TAG => {
+                lon_offset = prost::encoding::decode_varint(&mut block)? as i64;
+            }
+            _ => skip(wire_type, key, &mut block)?,
+        }
+    }
+
+    // second pass: fused decode; deltas restart with every dense message
+    let num_bytes: usize = dense_messages.iter().flat_map(|s| &s.ids).map(|s| s.len()).sum();
+    result.ids.reserve(num_bytes);
+    result.lats.reserve(num_bytes);
+    result.lons.reserve(num_bytes);
+    for slices in &dense_messages {
+        let mut id = 0;
+        for slice in &slices.ids {
+            decode_packed_deltas(slice, &mut id, &mut result.ids, |id| id)?;
+        }
+        let mut lat = 0;
+        for slice in &slices.lats {
+            decode_packed_deltas(slice, &mut lat, &mut result.lats, |lat| {
+                lat_offset + granularity * lat
+            })?;
+        }
+        let mut lon = 0;
+        for slice in &slices.lons {
+            decode_packed_deltas(slice, &mut lon, &mut result.lons, |lon| {
+                lon_offset + granularity * lon
+            })?;
+        }
+        for slice in &slices.keys_vals {
+            decode_packed_i32(slice, &mut result.keys_vals)?;
+        }
+    }
+    if result.ids.len() != result.lats.len() || result.ids.len() != result.lons.len() {
+        return Err(io::Error::new(
+            io::ErrorKind::InvalidData,
+            "dense nodes arrays of inconsistent length",
+        ));
+    }
+    Ok(result)
+}
+
+/// Payload of a blob, borrowed from the undecoded `Blob` wire bytes.
+enum BlobPayload<'a> {
+    Raw(&'a [u8]),
+    Zlib(&'a [u8]),
+}
+
+/// Locates the payload field of a `Blob` message without decoding it.
+///
+/// Unlike `Blob::decode`, this borrows the (possibly compressed) payload from
+/// the input instead of copying it into an owned message.
+fn blob_payload(blob: &[u8]) -> Result<BlobPayload<'_>, io::Error> {
+    const RAW_TAG: u32 = 1;
+    const ZLIB_DATA_TAG: u32 = 3;
+
+    let mut cursor = Cursor::new(blob);
+    while (cursor.position() as usize) < blob.len() {
+        let (key, wire_type) = prost::encoding::decode_key(&mut cursor)?;
+        if (key == RAW_TAG || key == ZLIB_DATA_TAG)
+            && wire_type == prost::encoding::WireType::LengthDelimited
+        {
+            let len = prost::encoding::decode_varint(&mut cursor)? as usize;
+            let start = cursor.position() as usize;
+            let data = blob.get(start..start + len).ok_or_else(|| {
+                io::Error::new(io::ErrorKind::InvalidData, "truncated blob payload")
+            })?;
+            return Ok(match key {
+                RAW_TAG => BlobPayload::Raw(data),
+                _ => BlobPayload::Zlib(data),
+            });
+        }
+        prost::encoding::skip_field(
+            wire_type,
+            key,
+            &mut cursor,
+            prost::encoding::DecodeContext::default(),
+        )?;
+    }
+    Err(io::Error::new(
+        io::ErrorKind::InvalidData,
+        "unknown compression",
+    ))
+}
+
+/// Pool of reusable decompression buffers.
+///
+/// Dense blocks decompress into buffers of several MB each. Allocating a
+/// fresh one per block churns the allocator and pays for page faults and
+/// zeroing on every block. Instead, buffers are recycled through this pool:
+/// [`decompress_block`] borrows one and returns it via the [`PooledBuffer`]
+/// guard when the decoded block is dropped.
+#[derive(Debug, Default)]
+pub struct BufferPool {
+    buffers: Mutex<Vec<Vec<u8>>>,
+}
+
+impl BufferPool {
+    /// Maximal number of idle buffers kept around for reuse.
+    const MAX_IDLE_BUFFERS: usize = 64;
+
+    pub fn new() -> Self {
+        Default::default()
+    }
+
+    fn get(&self) -> PooledBuffer<'_> {
+        let buf = self.buffers.lock().pop().unwrap_or_default();
+        PooledBuffer { buf, pool: self }
+    }
+
+    fn put_back(&self, buf: Vec<u8>) {
+        let mut buffers = self.buffers.lock();
+        if buffers.len() < Self::MAX_IDLE_BUFFERS {
+            buffers.push(buf);
+        }
+    }
+}
+
+/// Buffer borrowed from a [`BufferPool`]; returns itself to the pool on drop.
+#[derive(Debug)]
+pub struct PooledBuffer<'a> {
+    buf: Vec<u8>,
+    pool: &'a BufferPool,
+}
+
+impl Deref for PooledBuffer<'_> {
+    type Target = [u8];
+    fn deref(&self) -> &[u8] {
+        &self.buf
+    }
+}
+
+impl Drop for PooledBuffer<'_> {
+    fn drop(&mut self) {
+        let mut buf = mem::take(&mut self.buf);
+        buf.clear();
+        self.pool.put_back(buf);
+    }
+}
+
+/// First pipeline stage: decompresses the blob at `idx` into a pooled buffer.
+pub fn decompress_block<'a>(
     data: &[u8],
     idx: &BlockIndex,
-) -> Result<T, io::Error> {
+    pool: &'a BufferPool,
+) -> Result<PooledBuffer<'a>, io::Error> {
     let blob = Blob::decode(&data[idx.blob_start..idx.blob_start + idx.blob_len])?;
 
-    let mut blob_buf = Vec::new();
-    let blob_data = if blob.raw.is_some() {
-        blob.raw.as_ref().unwrap()
-    } else if blob.zlib_data.is_some() {
-        // decompress zlib data
-        let data: &Vec<u8> = blob.zlib_data.as_ref().unwrap();
-        let mut decoder = ZlibDecoder::new(&data[..]);
-        decoder.read_to_end(&mut blob_buf)?;
-        &blob_buf
+    let mut buffer = pool.get();
+    if let Some(raw) = &blob.raw {
+        buffer.buf.extend_from_slice(raw);
+    } else if let Some(zlib_data) = &blob.zlib_data {
+        let mut decoder = ZlibDecoder::new(&zlib_data[..]);
+        if let Some(raw_size) = blob.raw_size {
+            buffer.buf.reserve(raw_size as usize);
+        }
+        decoder.read_to_end(&mut buffer.buf)?;
     } else {
         return Err(io::Error::new(
             io::ErrorKind::InvalidData,
             "unknown compression",
         ));
-    };
-    Ok(T::decode(blob_data.as_slice())?)
+    }
+    Ok(buffer)
+}
+
+/// Second pipeline stage: decodes a protobuf message from decompressed bytes.
+pub fn decode_block<T: prost::Message + Default>(blob_data: &[u8]) -> Result<T, io::Error> {
+    Ok(T::decode(blob_data)?)
+}
+
+pub fn read_block<T: prost::Message + Default>(
+    data: &[u8],
+    idx: &BlockIndex,
+    pool: &BufferPool,
+) -> Result<T, io::Error> {
+    let blob_data = decompress_block(data, idx, pool)?;
+    decode_block(&blob_data)
 }
 
 fn blob_type_from_blob_info(
     blob_start: usize,
     blob_len: usize,
-    blob: Vec<u8>,
+    blob: &[u8],
 ) -> Result<BlockIndex, io::Error> {
-    let blob = Blob::decode(blob.as_slice())?;
+    // Number of decompressed bytes inflated per detection attempt. The
+    // PrimitiveGroup tag sits right behind the block's stringtable, so a few
+    // KB are usually enough and the rest of the block is never inflated.
+    const DETECTION_CHUNK_LEN: u64 = 16 * 1024;
 
-    let mut blob_buf = Vec::new();
-    let blob_data = if blob.raw.is_some() {
-        // use raw bytes
-        blob.raw.as_ref().unwrap()
-    } else if blob.zlib_data.is_some() {
-        // decompress zlib data
-        let data: &Vec<u8> = blob.zlib_data.as_ref().unwrap();
-        let mut decoder = ZlibDecoder::new(&data[..]);
-        decoder.read_to_end(&mut blob_buf)?;
-        &blob_buf
-    } else {
-        panic!("can only read raw or zlib compressed blob");
+    let block_type = match blob_payload(blob)? {
+        BlobPayload::Raw(data) => BlockType::from_osmdata_blob(data)?,
+        BlobPayload::Zlib(data) => {
+            // Decompress incrementally and abort the inflate as soon as the
+            // decompressed prefix suffices to detect the block type.
+            let mut decoder = ZlibDecoder::new(data);
+            let mut buf = Vec::with_capacity(DETECTION_CHUNK_LEN as usize);
+            loop {
+                let num_read = (&mut decoder).take(DETECTION_CHUNK_LEN).read_to_end(&mut buf)?;
+                match BlockType::from_osmdata_blob(&buf) {
+                    Ok(block_type) => break block_type,
+                    // the prefix was too short -- inflate more, unless the
+                    // stream is exhausted and the blob is really malformed
+                    Err(e) => {
+                        if num_read == 0 {
+                            return Err(e);
+                        }
+                    }
+                }
+            }
+        }
     };
-    assert_eq!(
-        blob_data.len(),
-        blob.raw_size.unwrap_or_else(|| blob_data.len() as i32) as usize
-    );
 
     Ok(BlockIndex {
-        block_type: BlockType::from_osmdata_blob(&blob_data[..])?,
+        block_type,
         blob_start,
         blob_len,
     })
@@ -225,3 +710,137 @@ pub fn build_block_index(pbf_data: &[u8]) -> Vec<BlockIndex> {
     info!("Found {} blocks", result.len());
     result
 }
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    #[test]
+    fn test_decode_packed_deltas_rejects_corrupt_varints() {
+        let mut out = Vec::new();
+        // over-long varint: more than 10 bytes of continuation
+        let overlong = [0x80_u8; 11];
+        let err = decode_packed_deltas(&overlong, &mut 0, &mut out, |v| v).unwrap_err();
+        assert_eq!(err.kind(), io::ErrorKind::InvalidData);
+        // truncated varint: continuation bit set on the last byte
+        let truncated = [0x02, 0x80];
+        let err = decode_packed_deltas(&truncated, &mut 0, &mut out, |v| v).unwrap_err();
+        assert_eq!(err.kind(), io::ErrorKind::InvalidData);
+        // the valid prefix before the error is still decoded
+        assert_eq!(out, vec![1]);
+    }
+
+    #[test]
+    fn test_decode_dense_nodes_matches_full_decode() {
+        let block = PrimitiveBlock {
+            stringtable: StringTable {
+                s: vec![b"".to_vec(), b"highway".to_vec(), b"primary".to_vec()],
+            },
+            primitivegroup: vec![
+                PrimitiveGroup {
+                    dense: Some(DenseNodes {
+                        id: vec![1000, 1, 2, -1],
+                        lat: vec![515_000_000, -10, 0, 300],
+                        lon: vec![-1, 1, 7, i32::max_value() as i64],
+                        keys_vals: vec![0, 1, 2, 0, 0, 1, 2, 0],
+                        ..Default::default()
+                    }),
+                    ..Default::default()
+                },
+                // deltas restart with every dense message
+                PrimitiveGroup {
+                    dense: Some(DenseNodes {
+                        id: vec![5],
+                        lat: vec![-300],
+                        lon: vec![42],
+                        keys_vals: vec![0],
+                        ..Default::default()
+                    }),
+                    ..Default::default()
+                },
+            ],
+            granularity: Some(100),
+            lat_offset: Some(1_000),
+            lon_offset: Some(-2_000),
+            ..Default::default()
+        };
+
+        let mut buf = Vec::new();
+        block.encode(&mut buf).unwrap();
+        let decoded = decode_dense_nodes(&buf).unwrap();
+
+        let mut expected_ids = Vec::new();
+        let mut expected_lats = Vec::new();
+        let mut expected_lons = Vec::new();
+        let mut expected_keys_vals = Vec::new();
+        for group in &block.primitivegroup {
+            let dense = group.dense.as_ref().unwrap();
+            let (mut id, mut lat, mut lon) = (0, 0, 0);
+            for i in 0..dense.id.len() {
+                id += dense.id[i];
+                lat += dense.lat[i];
+                lon += dense.lon[i];
+                expected_ids.push(id);
+                expected_lats.push(block.lat_offset.unwrap() + 100 * lat);
+                expected_lons.push(block.lon_offset.unwrap() + 100 * lon);
+            }
+            expected_keys_vals.extend_from_slice(&dense.keys_vals);
+        }
+
+        assert_eq!(decoded.ids, expected_ids);
+        assert_eq!(decoded.lats, expected_lats);
+        assert_eq!(decoded.lons, expected_lons);
+        assert_eq!(decoded.keys_vals, expected_keys_vals);
+        assert_eq!(decoded.stringtable, block.stringtable);
+    }
+
+    #[test]
+    fn test_read_relation_ids_matches_full_decode() {
+        let block = PrimitiveBlock {
+            stringtable: StringTable {
+                s: vec![b"".to_vec(), b"role".to_vec()],
+            },
+            primitivegroup: vec![
+                PrimitiveGroup {
+                    relations: vec![
+                        Relation {
+                            id: 42,
+                            keys: vec![1],
+                            vals: vec![1],
+                            roles_sid: vec![1],
+                            memids: vec![7],
+                            types: vec![relation::MemberType::Node as i32],
+                            ..Default::default()
+                        },
+                        Relation {
+                            id: i64::max_value() >> 1,
+                            ..Default::default()
+                        },
+                    ],
+                    ..Default::default()
+                },
+                PrimitiveGroup {
+                    relations: vec![Relation {
+                        id: 1,
+                        ..Default::default()
+                    }],
+                    ..Default::default()
+                },
+            ],
+            ..Default::default()
+        };
+
+        let mut buf = Vec::new();
+        block.encode(&mut buf).unwrap();
+
+        let mut ids = Vec::new();
+        read_relation_ids(&buf, &mut ids).unwrap();
+
+        let expected: Vec<u64> = block
+            .primitivegroup
+            .iter()
+            .flat_map(|group| group.relations.iter().map(|relation| relation.id as u64))
+            .collect();
+        assert_eq!(ids, expected);
+    }
+}
@@ -4,6 +4,59 @@ use std::sync::{mpsc::sync_channel, Arc};
 
 use parking_lot::{Condvar, Mutex};
 
+/// Limits how many blocks may be claimed but not yet consumed.
+///
+/// Producers take a permit *before* claiming an item and the consumer
+/// returns it once the block left the reorder buffer, so the limit bounds
+/// memory while a worker never parks holding a finished block: with
+/// heterogeneous block sizes (tiny relation blocks next to huge dense-node
+/// blocks), making producers wait until their index is close to the
+/// consumer parked every worker behind one slow block.
+struct Window {
+    state: Mutex<WindowState>,
+    cond: Condvar,
+}
+
+struct WindowState {
+    permits: usize,
+    aborted: bool,
+}
+
+impl Window {
+    fn new(permits: usize) -> Self {
+        Self {
+            state: Mutex::new(WindowState {
+                permits,
+                aborted: false,
+            }),
+            cond: Condvar::new(),
+        }
+    }
+
+    /// Takes a permit; returns `false` if the consumer aborted.
+    fn acquire(&self) -> bool {
+        let mut state = self.state.lock();
+        while state.permits == 0 && !state.aborted {
+            self.cond.wait(&mut state);
+        }
+        if state.aborted {
+            return false;
+        }
+        state.permits -= 1;
+        true
+    }
+
+    fn release(&self) {
+        self.state.lock().permits += 1;
+        self.cond.notify_one();
+    }
+
+    fn abort(&self) {
+        self.state.lock().aborted = true;
+        self.cond.notify_all();
+    }
+}
+
 pub fn parallel_process<Iter, Item, Producer, Data, Consumer, Error>(
     iter: Iter,
     produce: Producer,
@@ -17,36 +70,45 @@ where
 {
     let num_threads = rayon::current_num_threads();
 
+    // Idle workers claim the next block from the shared iterator, so slow
+    // blocks never hold up the assignment of the ones behind them. The
+    // window bounds the claimed blocks; with one permit per block a few
+    // times the thread count keeps every worker busy while the reorder
+    // buffer stays small.
     let iter = Arc::new(Mutex::new(iter.enumerate()));
-    let next = Arc::new((Mutex::new(20 * num_threads), Condvar::new()));
+    let window = Arc::new(Window::new(8 * num_threads));
 
     crossbeam::scope(|s| {
-        let (sender, receiver) = sync_channel(20 * num_threads);
+        // capacity matches the permits, so sending never blocks
+        let (sender, receiver) = sync_channel(8 * num_threads);
         for _ in 0..num_threads {
             let sender = sender.clone();
             let iter = iter.clone();
+            let window = window.clone();
             s.spawn(|_| {
                 let sender = sender;
                 let iter = iter;
+                let window = window;
                 loop {
+                    if !window.acquire() {
+                        break;
+                    }
                     let (i, item) = {
                         match iter.lock().next() {
-                            None => break,
+                            None => {
+                                window.release(); // wake workers parked on the window
+                                break;
+                            }
                             Some(x) => x,
                         }
                     };
 
                     let data = produce(item);
-
-                    let (counter, cond) = &*next;
-                    {
-                        let mut guard = counter.lock();
-                        while *guard <= i {
-                            cond.wait(&mut guard);
-                        }
+                    // the receiver is gone once the consumer errored out;
+                    // drop the block and let the producer wind down
+                    if sender.send((i, data)).is_err() {
+                        break;
                     }
-
-                    sender.send((i, data)).unwrap();
                 }
             });
         }
@@ -57,17 +119,59 @@ where
         for result in receiver {
             pending.insert(Reverse(result.0), result.1);
             while let Some(data) = pending.remove(&Reverse(next_idx)) {
-                {
-                    let mut guard = next.0.lock();
-                    *guard += 1;
-                    next.1.notify_all();
-                }
-
+                window.release();
                 next_idx += 1;
-                consume(data)?;
+                if let Err(e) = consume(data) {
+                    window.abort(); // unpark producers so the scope can join
+                    return Err(e);
+                }
             }
         }
         Ok(())
     })
     .expect("thread panicked")
 }
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    #[test]
+    fn test_consumes_in_order() {
+        let mut consumed = Vec::new();
+        parallel_process(
+            0..1000_u64,
+            |i| {
+                if i % 7 == 0 {
+                    // uneven block costs exercise the reorder buffer
+                    std::thread::sleep(std::time::Duration::from_micros(100));
+                }
+                i * 2
+            },
+            |data| {
+                consumed.push(data);
+                Ok(()) as Result<(), ()>
+            },
+        )
+        .unwrap();
+        assert_eq!(consumed, (0..1000_u64).map(|i| i * 2).collect::<Vec<_>>());
+    }
+
+    #[test]
+    fn test_consumer_error_terminates() {
+        let mut consumed = 0;
+        let result = parallel_process(
+            0..1000_u64,
+            |i| i,
+            |data| {
+                if data == 10 {
+                    return Err("failed");
+                }
+                consumed += 1;
+                Ok(())
+            },
+        );
+        assert_eq!(result, Err("failed"));
+        assert_eq!(consumed, 10);
+    }
+}
@@ -1,5 +1,10 @@
+use std::alloc::{GlobalAlloc, Layout, System};
 use std::fmt;
+use std::fs;
+use std::io;
 use std::ops::AddAssign;
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::time::{Duration, Instant};
 
 #[derive(Debug, Default)]
 pub struct Stats {
@@ -44,3 +49,213 @@ Unresolved ids:
         )
     }
 }
+
+/// Allocator wrapper counting allocations, for the `--timings` report.
+///
+/// Registered as the global allocator in `main.rs`; the two relaxed atomic
+/// increments per allocation are negligible next to the allocations
+/// themselves.
+pub struct CountingAllocator;
+
+static NUM_ALLOCATIONS: AtomicU64 = AtomicU64::new(0);
+static ALLOCATED_BYTES: AtomicU64 = AtomicU64::new(0);
+
+unsafe impl GlobalAlloc for CountingAllocator {
+    unsafe fn alloc(&self, layout: Layout) -> *mut u8 {
+        NUM_ALLOCATIONS.fetch_add(1, Ordering::Relaxed);
+        ALLOCATED_BYTES.fetch_add(layout.size() as u64, Ordering::Relaxed);
+        System.alloc(layout)
+    }
+
+    unsafe fn dealloc(&self, ptr: *mut u8, layout: Layout) {
+        System.dealloc(ptr, layout)
+    }
+
+    unsafe fn realloc(&self, ptr: *mut u8, layout: Layout, new_size: usize) -> *mut u8 {
+        NUM_ALLOCATIONS.fetch_add(1, Ordering::Relaxed);
+        ALLOCATED_BYTES.fetch_add(new_size as u64, Ordering::Relaxed);
+        System.realloc(ptr, layout, new_size)
+    }
+}
+
+/// Point-in-time snapshot of the process counters a stage is measured with.
+#[derive(Debug, Clone, Copy)]
+struct Snapshot {
+    wall: Instant,
+    cpu: Duration,
+    bytes_read: u64,
+    bytes_written: u64,
+    num_allocations: u64,
+    allocated_bytes: u64,
+}
+
+impl Snapshot {
+    fn now() -> Self {
+        let (bytes_read, bytes_written) = io_bytes();
+        Self {
+            wall: Instant::now(),
+            cpu: cpu_time(),
+            bytes_read,
+            bytes_written,
+            num_allocations: NUM_ALLOCATIONS.load(Ordering::Relaxed),
+            allocated_bytes: ALLOCATED_BYTES.load(Ordering::Relaxed),
+        }
+    }
+}
+
+/// Measurements of one pipeline stage.
+#[derive(Debug)]
+pub struct StageStats {
+    pub name: &'static str,
+    pub wall: Duration,
+    /// User + system CPU time across all threads.
+    pub cpu: Duration,
+    pub bytes_read: u64,
+    pub bytes_written: u64,
+    pub num_allocations: u64,
+    pub allocated_bytes: u64,
+    /// Peak RSS of the process at the end of the stage.
+    pub peak_rss_bytes: u64,
+}
+
+/// Per-stage resource measurements of the conversion pipeline.
+#[derive(Debug, Default)]
+pub struct Timings {
+    stages: Vec<StageStats>,
+}
+
+impl Timings {
+    pub fn new() -> Self {
+        Default::default()
+    }
+
+    /// Runs `f` and records its resource usage as stage `name`.
+    pub fn measure<T>(&mut self, name: &'static str, f: impl FnOnce() -> T) -> T {
+        let before = Snapshot::now();
+        let result = f();
+        let after = Snapshot::now();
+        self.stages.push(StageStats {
+            name,
+            wall: after.wall - before.wall,
+            cpu: after.cpu.checked_sub(before.cpu).unwrap_or_default(),
+            bytes_read: after.bytes_read - before.bytes_read,
+            bytes_written: after.bytes_written - before.bytes_written,
+            num_allocations: after.num_allocations - before.num_allocations,
+            allocated_bytes: after.allocated_bytes - before.allocated_bytes,
+            peak_rss_bytes: peak_rss(),
+        });
+        result
+    }
+
+    /// Writes the report as a JSON array of per-stage objects.
+    pub fn write_json(&self, out: &mut dyn io::Write) -> io::Result<()> {
+        writeln!(out, "[")?;
+        for (i, stage) in self.stages.iter().enumerate() {
+            let delim = if i + 1 < self.stages.len() { "," } else { "" };
+            writeln!(
+                out,
+                r#"  {{"stage": "{}", "wall_ms": {:.3}, "cpu_ms": {:.3}, "bytes_read": {}, "bytes_written": {}, "num_allocations": {}, "allocated_bytes": {}, "peak_rss_bytes": {}}}{}"#,
+                stage.name,
+                stage.wall.as_secs_f64() * 1e3,
+                stage.cpu.as_secs_f64() * 1e3,
+                stage.bytes_read,
+                stage.bytes_written,
+                stage.num_allocations,
+                stage.allocated_bytes,
+                stage.peak_rss_bytes,
+                delim,
+            )?;
+        }
+        writeln!(out, "]")?;
+        Ok(())
+    }
+}
+
+/// User + system CPU time of the process.
+#[cfg(unix)]
+fn cpu_time() -> Duration {
+    let mut usage = std::mem::MaybeUninit::<libc::rusage>::zeroed();
+    let res = unsafe { libc::getrusage(libc::RUSAGE_SELF, usage.as_mut_ptr()) };
+    if res != 0 {
+        return Duration::default();
+    }
+    let usage = unsafe { usage.assume_init() };
+    let timeval_to_duration =
+        |tv: libc::timeval| Duration::new(tv.tv_sec as u64, tv.tv_usec as u32 * 1000);
+    timeval_to_duration(usage.ru_utime) + timeval_to_duration(usage.ru_stime)
+}
+
+/// User + system CPU time of the process; not available on this platform.
+#[cfg(not(unix))]
+fn cpu_time() -> Duration {
+    Duration::default()
+}
+
+/// Peak RSS of the process in bytes.
+#[cfg(unix)]
+fn peak_rss() -> u64 {
+    let mut usage = std::mem::MaybeUninit::<libc::rusage>::zeroed();
+    let res = unsafe { libc::getrusage(libc::RUSAGE_SELF, usage.as_mut_ptr()) };
+    if res != 0 {
+        return 0;
+    }
+    let usage = unsafe { usage.assume_init() };
+    // ru_maxrss is in KB on Linux and in bytes on macOS
+    if cfg!(target_os = "macos") {
+        usage.ru_maxrss as u64
+    } else {
+        usage.ru_maxrss as u64 * 1024
+    }
+}
+
+/// Peak RSS of the process in bytes; not available on this platform.
+#[cfg(not(unix))]
+fn peak_rss() -> u64 {
+    0
+}
+
+/// Bytes read from and written to storage by the process, if available.
+fn io_bytes() -> (u64, u64) {
+    if let Ok(io) = fs::read_to_string("/proc/self/io") {
+        let field = |name: &str| {
+            io.lines()
+                .find_map(|line| line.strip_prefix(name))
+                .and_then(|value| value.trim().parse().ok())
+                .unwrap_or(0)
+        };
+        (field("read_bytes:"), field("write_bytes:"))
+    } else {
+        (0, 0)
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    #[test]
+    fn test_measure_and_report() {
+        let mut timings = Timings::new();
+        let value = timings.measure("allocate", || vec![0_u8; 1 << 20].len());
+        assert_eq!(value, 1 << 20);
+        timings.measure("idle", || ());
+
+        let mut report = Vec::new();
+        timings.write_json(&mut report).unwrap();
+        let report = String::from_utf8(report).unwrap();
+        assert!(report.contains(r#""stage": "allocate""#));
+        assert!(report.contains(r#""stage": "idle""#));
+        // the 1 MB vector must show up in the allocation counters
+        let allocate = report.lines().find(|l| l.contains("allocate")).unwrap();
+        let allocated: u64 = allocate
+            .split(r#""allocated_bytes": "#)
+            .nth(1)
+            .unwrap()
+            .split(',')
+            .next()
+            .unwrap()
+            .parse()
+            .unwrap();
+        assert!(allocated >= 1 << 20);
+    }
+}
@@ -1,50 +1,174 @@
-use inlinable_string::{InlinableString, StringExt};
+use crate::fileio;
+
+use inlinable_string::InlinableString;
+use memmap::Mmap;
+use parking_lot::Mutex;
+
+use std::collections::hash_map::DefaultHasher;
 use std::collections::HashMap;
+use std::fs::File;
+use std::hash::{Hash, Hasher};
+use std::io;
+use std::ops::Deref;
+use std::sync::atomic::{AtomicU64, Ordering};
 
-#[derive(Debug, Default)]
+/// Number of shards the table is split into; must be a power of two.
+const NUM_SHARDS: usize = 64;
+
+/// Maximal number of strings kept in memory per shard.
+///
+/// Beyond this, the shard's index entries are demoted to the cold index,
+/// which stores only a hash and the byte offset per string.
+const HOT_SHARD_CAPACITY: usize = 32 * 1024;
+
+/// Deduplicating string table, sharded by string hash for concurrent access.
+///
+/// The indices handed out by [`insert`] are final byte offsets into the
+/// serialized table: the offset of a new string is reserved atomically on
+/// first insertion, so any number of threads can intern strings in parallel
+/// while only contending on the shard holding the string.
+///
+/// String bytes are not kept in memory. They are written at their final
+/// offset into an anonymous spill file as soon as the offset is reserved;
+/// [`into_bytes`] only has to map that file. For deduplication each shard
+/// keeps a bounded hot set of recently used strings in memory and a cold
+/// index of `(hash, offset)` entries; a cold hit is verified against the
+/// spill file and promoted back into the hot set.
+///
+/// [`insert`]: #method.insert
+/// [`into_bytes`]: #method.into_bytes
+#[derive(Debug)]
 pub struct StringTable {
-    indexed_data: HashMap<InlinableString, u64>,
-    size_in_bytes: u64,
+    shards: Vec<Mutex<Shard>>,
+    hot_shard_capacity: usize,
+    data: File,
+    size_in_bytes: AtomicU64,
+}
+
+#[derive(Debug, Default)]
+struct Shard {
+    /// Bounded in-memory set of recently inserted or hit strings.
+    hot: HashMap<InlinableString, u64>,
+    /// Offsets of spilled strings by hash; strings live only in `data`.
+    cold: HashMap<u64, Vec<u64>>,
+}
+
+fn hash_of(s: &str) -> u64 {
+    let mut hasher = DefaultHasher::new();
+    s.hash(&mut hasher);
+    hasher.finish()
 }
 
 impl StringTable {
-    pub fn new() -> Self {
-        Default::default()
+    pub fn new() -> io::Result<Self> {
+        Self::with_hot_capacity(HOT_SHARD_CAPACITY)
+    }
+
+    /// Creates a table which keeps at most `capacity` strings per shard in
+    /// memory.
+    pub fn with_hot_capacity(capacity: usize) -> io::Result<Self> {
+        Ok(Self {
+            shards: (0..NUM_SHARDS).map(|_| Mutex::new(Shard::default())).collect(),
+            hot_shard_capacity: capacity.max(1),
+            data: tempfile::tempfile()?,
+            size_in_bytes: AtomicU64::new(0),
+        })
     }
 
     pub fn next_index(&self) -> u64 {
-        self.size_in_bytes
+        self.size_in_bytes.load(Ordering::SeqCst)
     }
 
     /// Inserts a string into string table and returns its index.
     ///
     /// If the string was already inserted before, the string is deduplicated
     /// and the index to the previous string is returned.
-    pub fn insert(&mut self, s: &str) -> u64 {
+    pub fn insert(&self, s: &str) -> u64 {
+        let hash = hash_of(s);
+        let mut shard = self.shards[hash as usize % NUM_SHARDS].lock();
+
         // Horrible news, we cannot use entry API since it does not support Borrow
         // See: https://github.com/rust-lang/rust/issues/56167
-        if let Some(&idx) = self.indexed_data.get(s) {
+        if let Some(&idx) = shard.hot.get(s) {
+            return idx;
+        }
+
+        if let Some(idx) = self.find_spilled(&shard, hash, s) {
+            // promote, so repeated strings do not pay the disk probe again
+            self.make_room(&mut shard);
+            shard.hot.insert(s.into(), idx);
             return idx;
         }
 
-        let idx = self.size_in_bytes;
-        self.indexed_data.insert(s.into(), idx);
-        self.size_in_bytes += s.len() as u64 + 1;
+        let idx = self
+            .size_in_bytes
+            .fetch_add(s.len() as u64 + 1, Ordering::SeqCst);
+
+        // write the string bytes at their final offset; only the index entry
+        // is kept in memory
+        let mut bytes = Vec::with_capacity(s.len() + 1);
+        bytes.extend_from_slice(s.as_bytes());
+        bytes.push(b'\0');
+        fileio::write_all_at(&self.data, &bytes, idx)
+            .expect("failed to write to the string table spill file");
+
+        self.make_room(&mut shard);
+        shard.hot.insert(s.into(), idx);
         idx
     }
 
-    pub fn into_bytes(self) -> Vec<u8> {
-        let mut index: Vec<(&InlinableString, &u64)> = self.indexed_data.iter().collect();
-        index.sort_by_key(|(_, &idx)| idx);
+    /// Looks up `s` in the cold index, verifying candidates against the
+    /// spill file.
+    fn find_spilled(&self, shard: &Shard, hash: u64, s: &str) -> Option<u64> {
+        let candidates = shard.cold.get(&hash)?;
+        let mut buf = vec![0u8; s.len() + 1];
+        for &idx in candidates {
+            if fileio::read_exact_at(&self.data, &mut buf, idx).is_ok()
+                && &buf[..s.len()] == s.as_bytes()
+                && buf[s.len()] == b'\0'
+            {
+                return Some(idx);
+            }
+        }
+        None
+    }
 
-        let mut data = Vec::new();
-        data.reserve(self.size_in_bytes as usize);
-        for (s, &idx) in index {
-            assert!(data.len() as u64 == idx);
-            data.extend(s.as_bytes());
-            data.push(b'\0');
+    /// Demotes the shard's hot entries to the cold index if it is full.
+    fn make_room(&self, shard: &mut Shard) {
+        if shard.hot.len() < self.hot_shard_capacity {
+            return;
+        }
+        for (s, idx) in shard.hot.drain() {
+            shard.cold.entry(hash_of(&s)).or_default().push(idx);
+        }
+    }
+
+    pub fn into_bytes(self) -> io::Result<StringTableBytes> {
+        let size_in_bytes = self.size_in_bytes.into_inner();
+        self.data.set_len(size_in_bytes)?;
+        let mmap = if size_in_bytes > 0 {
+            // Safety: the spill file is anonymous and owned by this process
+            Some(unsafe { Mmap::map(&self.data)? })
+        } else {
+            None
+        };
+        Ok(StringTableBytes { mmap })
+    }
+}
+
+/// Serialized string table, backed by the memory mapped spill file.
+#[derive(Debug)]
+pub struct StringTableBytes {
+    mmap: Option<Mmap>,
+}
+
+impl Deref for StringTableBytes {
+    type Target = [u8];
+    fn deref(&self) -> &[u8] {
+        match &self.mmap {
+            Some(mmap) => mmap,
+            None => &[],
         }
-        data
     }
 }
 
@@ -56,7 +180,7 @@ mod test {
 
     #[test]
     fn test_simple_insert() {
-        let mut st = StringTable::new();
+        let st = StringTable::new().unwrap();
         assert_eq!(st.insert("hello"), 0);
         assert_eq!(st.insert("world"), 6);
         assert_eq!(st.insert("world"), 6);
@@ -64,9 +188,64 @@ mod test {
         assert_eq!(st.insert("!"), 6 + 6);
         assert_eq!(st.insert("!"), 6 + 6);
 
-        let bytes = st.into_bytes();
+        let bytes = st.into_bytes().unwrap();
         println!("{}", ::std::str::from_utf8(&bytes).unwrap());
-        assert_eq!(bytes, b"hello\0world\0!\0");
+        assert_eq!(&bytes[..], b"hello\0world\0!\0");
+    }
+
+    #[test]
+    fn test_spilling_dedup() {
+        // a hot capacity of 1 demotes the index to disk after every insert
+        let st = StringTable::with_hot_capacity(1).unwrap();
+        let first = st.insert("hello");
+        let second = st.insert("world");
+        for _ in 0..3 {
+            assert_eq!(st.insert("hello"), first);
+            assert_eq!(st.insert("world"), second);
+        }
+        assert_eq!(&st.into_bytes().unwrap()[..], b"hello\0world\0");
+    }
+
+    #[test]
+    fn test_parallel_insert() {
+        let st = StringTable::new().unwrap();
+        let indexes: Vec<Vec<(String, u64)>> = crossbeam::scope(|s| {
+            let handles: Vec<_> = (0..8)
+                .map(|thread| {
+                    let st = &st;
+                    s.spawn(move |_| {
+                        (0..1000)
+                            .map(|i| {
+                                let s = format!("string{}", i * (1 + thread % 2));
+                                let idx = st.insert(&s);
+                                (s, idx)
+                            })
+                            .collect()
+                    })
+                })
+                .map(|handle| handle.join().unwrap())
+                .collect();
+            handles
+        })
+        .unwrap();
+
+        // all threads agree on the index of every string
+        let mut expected = std::collections::HashMap::new();
+        for (s, idx) in indexes.into_iter().flatten() {
+            assert_eq!(*expected.entry(s.clone()).or_insert(idx), idx);
+        }
+
+        // the serialized table is dense and contains every string at its index
+        let bytes = st.into_bytes().unwrap();
+        assert_eq!(
+            bytes.len(),
+            expected.iter().map(|(s, _)| s.len() + 1).sum::<usize>()
+        );
+        for (s, idx) in expected {
+            let substr = &bytes[idx as usize..idx as usize + s.len() + 1];
+            assert_eq!(substr[..s.len()], *s.as_bytes());
+            assert_eq!(substr[s.len()], b'\0');
+        }
     }
 
     #[derive(Debug, Default)]
@@ -89,13 +268,13 @@ mod test {
         #[test]
         fn sequence_of_insert(ref seq in prop::collection::vec(".*", 1..100))
         {
-            let mut st = StringTable::new();
+            let st = StringTable::with_hot_capacity(4).unwrap();
             let mut reference_st = ReferenceStringTable::default();
             for input in seq {
                 st.insert(input);
                 reference_st.insert(input.into());
             }
-            assert_eq!(st.into_bytes(), reference_st.data);
+            assert_eq!(&st.into_bytes().unwrap()[..], &reference_st.data[..]);
         }
     }
 }
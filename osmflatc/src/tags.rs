@@ -0,0 +1,178 @@
+use crate::fileio;
+
+use parking_lot::Mutex;
+
+use std::collections::HashMap;
+use std::convert::TryInto;
+use std::fs::File;
+use std::io;
+use std::sync::atomic::{AtomicU64, Ordering};
+
+/// Number of shards the table is split into; must be a power of two.
+const NUM_SHARDS: usize = 64;
+
+/// Maximal number of pairs kept in memory per shard before it is spilled.
+const SHARD_CAPACITY: usize = 1 << 21;
+
+/// Size of one spilled entry: the 80-bit pair padded to 16 bytes plus the
+/// 8 byte tag index.
+const SPILLED_ENTRY_LEN: usize = 24;
+
+/// Deduplication table for `(key_idx, value_idx)` tag pairs.
+///
+/// The table is sharded by the hash of the packed 80-bit pair, with a mutex
+/// per shard, so it can be queried from multiple threads. When a shard
+/// exceeds its capacity, its entries are written to the spill file as a
+/// sorted run and the in-memory map is cleared; lookups that miss in memory
+/// binary-search the shard's runs on disk. This bounds the table's RSS on
+/// planet-sized input, where the pair map used to grow to hundreds of
+/// millions of entries.
+#[derive(Debug)]
+pub struct TagDedup {
+    shards: Vec<Mutex<Shard>>,
+    shard_capacity: usize,
+    spill: File,
+    spill_len: AtomicU64,
+}
+
+#[derive(Debug, Default)]
+struct Shard {
+    map: HashMap<u128, u64>,
+    /// Sorted runs spilled to disk as (file offset, number of entries).
+    runs: Vec<(u64, u64)>,
+}
+
+/// Packs a `(key_idx, value_idx)` pair of 40-bit stringtable references.
+pub fn pack_pair(key_idx: u64, val_idx: u64) -> u128 {
+    debug_assert!(key_idx < (1_u64 << 40) && val_idx < (1_u64 << 40));
+    (u128::from(key_idx) << 40) | u128::from(val_idx)
+}
+
+fn shard_of(pair: u128) -> usize {
+    // multiplicative hashing of the pair's low 64 bits; the high bits of the
+    // product select the shard
+    let h = (pair as u64).wrapping_mul(0x9e37_79b9_7f4a_7c15);
+    (h >> (64 - NUM_SHARDS.trailing_zeros())) as usize
+}
+
+impl TagDedup {
+    pub fn new() -> io::Result<Self> {
+        Self::with_shard_capacity(SHARD_CAPACITY)
+    }
+
+    /// Creates a table which keeps at most `capacity` pairs per shard in
+    /// memory.
+    pub fn with_shard_capacity(capacity: usize) -> io::Result<Self> {
+        Ok(Self {
+            shards: (0..NUM_SHARDS).map(|_| Mutex::new(Shard::default())).collect(),
+            shard_capacity: capacity.max(1),
+            spill: tempfile::tempfile()?,
+            spill_len: AtomicU64::new(0),
+        })
+    }
+
+    /// Returns the tag index of `pair`, or inserts it with the index
+    /// provided by `alloc`.
+    pub fn get_or_insert(
+        &self,
+        pair: u128,
+        alloc: impl FnOnce() -> io::Result<u64>,
+    ) -> io::Result<u64> {
+        let mut shard = self.shards[shard_of(pair)].lock();
+
+        if let Some(&idx) = shard.map.get(&pair) {
+            return Ok(idx);
+        }
+        if let Some(idx) = self.find_spilled(&shard, pair)? {
+            return Ok(idx);
+        }
+
+        let idx = alloc()?;
+        if shard.map.len() >= self.shard_capacity {
+            self.spill_shard(&mut shard)?;
+        }
+        shard.map.insert(pair, idx);
+        Ok(idx)
+    }
+
+    /// Binary-searches the shard's spilled runs for `pair`, newest first.
+    fn find_spilled(&self, shard: &Shard, pair: u128) -> io::Result<Option<u64>> {
+        let mut buf = [0_u8; SPILLED_ENTRY_LEN];
+        for &(run_start, num_entries) in shard.runs.iter().rev() {
+            let mut lo = 0_u64;
+            let mut hi = num_entries;
+            while lo < hi {
+                let mid = lo + (hi - lo) / 2;
+                fileio::read_exact_at(
+                    &self.spill,
+                    &mut buf,
+                    run_start + mid * SPILLED_ENTRY_LEN as u64,
+                )?;
+                let mid_pair = u128::from_le_bytes(buf[..16].try_into().unwrap());
+                if mid_pair < pair {
+                    lo = mid + 1;
+                } else if mid_pair > pair {
+                    hi = mid;
+                } else {
+                    let idx = u64::from_le_bytes(buf[16..].try_into().unwrap());
+                    return Ok(Some(idx));
+                }
+            }
+        }
+        Ok(None)
+    }
+
+    /// Writes the shard's in-memory entries to the spill file as a sorted
+    /// run and clears the map.
+    fn spill_shard(&self, shard: &mut Shard) -> io::Result<()> {
+        let mut entries: Vec<(u128, u64)> = shard.map.drain().collect();
+        entries.sort_unstable_by_key(|&(pair, _)| pair);
+
+        let mut bytes = Vec::with_capacity(entries.len() * SPILLED_ENTRY_LEN);
+        for (pair, idx) in &entries {
+            bytes.extend_from_slice(&pair.to_le_bytes());
+            bytes.extend_from_slice(&idx.to_le_bytes());
+        }
+
+        let run_start = self
+            .spill_len
+            .fetch_add(bytes.len() as u64, Ordering::SeqCst);
+        fileio::write_all_at(&self.spill, &bytes, run_start)?;
+        shard.runs.push((run_start, entries.len() as u64));
+        Ok(())
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    fn check_dedup(dedup: TagDedup, num_pairs: u64, num_rounds: u64) {
+        let next_idx = AtomicU64::new(0);
+        let mut expected = HashMap::new();
+        for round in 0..num_rounds {
+            for key in 0..num_pairs {
+                let pair = pack_pair(key, key % 7);
+                let idx = dedup
+                    .get_or_insert(pair, || Ok(next_idx.fetch_add(1, Ordering::SeqCst)))
+                    .unwrap();
+                let prev = *expected.entry(pair).or_insert(idx);
+                assert_eq!(prev, idx, "pair {} changed index in round {}", key, round);
+            }
+        }
+        // every pair got a distinct index
+        assert_eq!(next_idx.into_inner(), num_pairs);
+    }
+
+    #[test]
+    fn test_dedup_in_memory() {
+        check_dedup(TagDedup::new().unwrap(), 1000, 3);
+    }
+
+    #[test]
+    fn test_dedup_with_spilling() {
+        // a capacity of 16 forces many spilled runs per shard
+        let dedup = TagDedup::with_shard_capacity(16).unwrap();
+        check_dedup(dedup, 10_000, 2);
+    }
+}
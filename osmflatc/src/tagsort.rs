@@ -0,0 +1,384 @@
+//! Reorders tags and strings of a finished archive by reference frequency.
+//!
+//! `TagSerializer` assigns tag and string indices in first-seen order, which
+//! scatters the few thousand hottest tags (`highway=residential`,
+//! `building=yes`, ...) across the whole `tags` vector and `stringtable`.
+//! Since the vast majority of `tags_index` entries reference exactly those
+//! tags, scans dereferencing them are bound by DRAM latency.
+//!
+//! This post-pass permutes `tags` by descending reference count and rebuilds
+//! the `stringtable` by descending dereference weight, then rewrites every
+//! resource holding indices into them: `tags_index`, the tag key/value
+//! offsets, the role offsets inside `relation_members` and the string
+//! references of the `header`. After the pass the hottest tags and strings
+//! are packed into the first few hundred KB of their resources and stay
+//! cache-resident during scans. The permutation is invisible through the
+//! reader API.
+
+use flatdata::Struct;
+use osmflat::{Header, NodeMember, RelationMember, Tag, TagIndex, WayMember};
+
+use std::cmp::Reverse;
+use std::collections::HashMap;
+use std::convert::TryInto;
+use std::fs;
+use std::io::{self, BufWriter, Write};
+use std::path::Path;
+
+use crate::Error;
+
+const TAG_SIZE: usize = <Tag as Struct>::SIZE_IN_BYTES;
+const TAG_INDEX_SIZE: usize = <TagIndex as Struct>::SIZE_IN_BYTES;
+const MEMBER_SIZE: usize = <NodeMember as Struct>::SIZE_IN_BYTES;
+
+/// Reads the payload of a flatdata resource file (size prefix stripped).
+fn read_resource(archive_dir: &Path, name: &str) -> Result<Vec<u8>, Error> {
+    let bytes = fs::read(archive_dir.join(name))?;
+    if bytes.len() < 8 {
+        return Err(format!("resource {} is truncated", name).into());
+    }
+    let size = u64::from_le_bytes(bytes[..8].try_into().unwrap()) as usize;
+    if bytes.len() < 8 + size {
+        return Err(format!("resource {} is truncated", name).into());
+    }
+    Ok(bytes[8..8 + size].to_vec())
+}
+
+/// Writes a flatdata resource file: size prefix, payload and padding.
+fn write_resource(archive_dir: &Path, name: &str, data: &[u8]) -> io::Result<()> {
+    let file = fs::File::create(archive_dir.join(name))?;
+    let mut writer = BufWriter::new(file);
+    writer.write_all(&(data.len() as u64).to_le_bytes())?;
+    writer.write_all(data)?;
+    writer.write_all(&[0_u8; 8])?;
+    writer.flush()
+}
+
+/// Rebuilt stringtable together with the remapping of old into new offsets.
+///
+/// Strings are tracked by their canonical start offset; references into the
+/// middle of a string (suffix sharing) are remapped by their distance to the
+/// canonical start, which placement preserves.
+struct StringRemap<'a> {
+    old: &'a [u8],
+    /// Sorted canonical string start offsets in the old table.
+    starts: Vec<usize>,
+    /// New start offset per string in `starts`; `usize::MAX` if unplaced.
+    new_starts: Vec<usize>,
+    data: Vec<u8>,
+}
+
+impl<'a> StringRemap<'a> {
+    fn new(old: &'a [u8]) -> Self {
+        let mut starts = Vec::new();
+        let mut start = 0;
+        while start < old.len() {
+            starts.push(start);
+            let len = old[start..].iter().position(|&byte| byte == b'\0');
+            start += len.map_or_else(|| old.len() - start, |len| len + 1);
+        }
+        let new_starts = vec![usize::MAX; starts.len()];
+        Self {
+            old,
+            starts,
+            new_starts,
+            data: Vec::with_capacity(old.len()),
+        }
+    }
+
+    /// Index into `starts` of the string containing `offset`.
+    fn string_at(&self, offset: usize) -> usize {
+        match self.starts.binary_search(&offset) {
+            Ok(pos) => pos,
+            Err(pos) => pos - 1,
+        }
+    }
+
+    fn end_of(&self, string: usize) -> usize {
+        self.starts
+            .get(string + 1)
+            .copied()
+            .unwrap_or_else(|| self.old.len())
+    }
+
+    /// Appends the string to the new table unless it is already placed.
+    fn place(&mut self, string: usize) {
+        if self.new_starts[string] != usize::MAX {
+            return;
+        }
+        self.new_starts[string] = self.data.len();
+        let end = self.end_of(string);
+        self.data.extend_from_slice(&self.old[self.starts[string]..end]);
+        if self.data.last() != Some(&b'\0') {
+            self.data.push(b'\0');
+        }
+    }
+
+    /// Copies the byte region `[first, end)` verbatim to the new table and
+    /// returns its new start offset.
+    ///
+    /// The header's feature lists are walked as consecutive strings, so
+    /// their regions must stay contiguous; a verbatim copy guarantees that
+    /// even if one of the strings is shared and placed elsewhere too.
+    fn place_region(&mut self, first: usize, end: usize) -> usize {
+        let new_first = self.data.len();
+        self.data.extend_from_slice(&self.old[first..end]);
+        let mut string = self.string_at(first);
+        while string < self.starts.len() && self.starts[string] < end {
+            if self.new_starts[string] == usize::MAX {
+                self.new_starts[string] = new_first + self.starts[string] - first;
+            }
+            string += 1;
+        }
+        new_first
+    }
+
+    /// Remaps an old string offset into the rebuilt table.
+    fn remap(&self, offset: u64) -> u64 {
+        let string = self.string_at(offset as usize);
+        (self.new_starts[string] + offset as usize - self.starts[string]) as u64
+    }
+}
+
+/// Walks the multivector payload of `relation_members`, calling `f` with the
+/// mutable struct bytes of every member.
+fn for_each_member(data: &mut [u8], mut f: impl FnMut(&mut [u8])) -> Result<(), Error> {
+    let mut pos = 0;
+    while pos < data.len() {
+        match data[pos] {
+            0..=2 => f(&mut data[pos + 1..pos + 1 + MEMBER_SIZE]),
+            other => return Err(format!("invalid relation member type {}", other).into()),
+        }
+        pos += 1 + MEMBER_SIZE;
+    }
+    Ok(())
+}
+
+/// End offset of a walk over `size` consecutive `\0` terminated strings.
+fn feature_walk_end(strings: &[u8], first_idx: usize, size: u32) -> usize {
+    let mut idx = first_idx;
+    for _ in 0..size {
+        let len = strings[idx..].iter().position(|&byte| byte == b'\0');
+        idx += len.map_or_else(|| strings.len() - idx, |len| len + 1);
+    }
+    idx
+}
+
+pub fn run(archive_dir: &Path) -> Result<(), Error> {
+    let tags_data = read_resource(archive_dir, "tags")?;
+    let tags_index_data = read_resource(archive_dir, "tags_index")?;
+    let strings = read_resource(archive_dir, "stringtable")?;
+    let header_data = read_resource(archive_dir, "header")?;
+    let mut members_data = read_resource(archive_dir, "relation_members")?;
+    if strings.is_empty() {
+        return Ok(()); // nothing to reorder
+    }
+
+    // count how often each tag is referenced
+    let num_tags = tags_data.len() / TAG_SIZE;
+    let mut counts = vec![0_u64; num_tags];
+    for chunk in tags_index_data.chunks_exact(TAG_INDEX_SIZE) {
+        counts[TagIndex::from_bytes_slice(chunk)?.value() as usize] += 1;
+    }
+
+    // permutation of tags by descending reference count
+    let mut order: Vec<u32> = (0..num_tags as u32).collect();
+    order.sort_by_key(|&old_idx| (Reverse(counts[old_idx as usize]), old_idx));
+    let mut new_idx_of_old = vec![0_u32; num_tags];
+    for (new_idx, &old_idx) in order.iter().enumerate() {
+        new_idx_of_old[old_idx as usize] = new_idx as u32;
+    }
+
+    // weigh strings by how often scans dereference them
+    let remap = StringRemap::new(&strings);
+    let mut weights: HashMap<usize, u64> = HashMap::new();
+    for (old_idx, chunk) in tags_data.chunks_exact(TAG_SIZE).enumerate() {
+        let tag = Tag::from_bytes_slice(chunk)?;
+        *weights.entry(remap.string_at(tag.key_idx() as usize)).or_insert(0) +=
+            counts[old_idx];
+        *weights.entry(remap.string_at(tag.value_idx() as usize)).or_insert(0) +=
+            counts[old_idx];
+    }
+    let mut remap = remap;
+    for_each_member(&mut members_data, |member| {
+        let role_idx = NodeMember::from_bytes_slice(member).unwrap().role_idx();
+        *weights.entry(remap.string_at(role_idx as usize)).or_insert(0) += 1;
+    })?;
+
+    // rebuild the stringtable: the header's feature walks stay contiguous at
+    // the front, everything else follows by descending weight
+    let header = Header::from_bytes_slice(&header_data)?;
+    let required_first = header.required_feature_first_idx() as usize;
+    let required_end =
+        feature_walk_end(&strings, required_first, header.required_features_size());
+    let new_required_first = remap.place_region(required_first, required_end);
+    let optional_first = header.optional_feature_first_idx() as usize;
+    let optional_end =
+        feature_walk_end(&strings, optional_first, header.optional_features_size());
+    let new_optional_first = remap.place_region(optional_first, optional_end);
+
+    let mut by_weight: Vec<usize> = (0..remap.starts.len()).collect();
+    by_weight.sort_by_key(|&string| {
+        (Reverse(weights.get(&string).copied().unwrap_or(0)), string)
+    });
+    for string in by_weight {
+        remap.place(string);
+    }
+
+    // rewrite tags in the new order with remapped string offsets
+    let mut new_tags_data = vec![0_u8; tags_data.len()];
+    for (chunk, &old_idx) in new_tags_data.chunks_exact_mut(TAG_SIZE).zip(&order) {
+        let old_tag = Tag::from_bytes_slice(&tags_data[old_idx as usize * TAG_SIZE..])?;
+        let new_tag = Tag::from_bytes_slice_mut(chunk)?;
+        new_tag.set_key_idx(remap.remap(old_tag.key_idx()));
+        new_tag.set_value_idx(remap.remap(old_tag.value_idx()));
+    }
+
+    // rewrite all references into the permuted resources
+    let mut new_tags_index_data = tags_index_data;
+    for chunk in new_tags_index_data.chunks_exact_mut(TAG_INDEX_SIZE) {
+        let entry = TagIndex::from_bytes_slice_mut(chunk)?;
+        let new_value = u64::from(new_idx_of_old[entry.value() as usize]);
+        entry.set_value(new_value);
+    }
+    let mut pos = 0;
+    while pos < members_data.len() {
+        let member_type = members_data[pos];
+        let member = &mut members_data[pos + 1..pos + 1 + MEMBER_SIZE];
+        match member_type {
+            0 => {
+                let member = NodeMember::from_bytes_slice_mut(member)?;
+                let new_role_idx = remap.remap(member.role_idx());
+                member.set_role_idx(new_role_idx);
+            }
+            1 => {
+                let member = WayMember::from_bytes_slice_mut(member)?;
+                let new_role_idx = remap.remap(member.role_idx());
+                member.set_role_idx(new_role_idx);
+            }
+            _ => {
+                let member = RelationMember::from_bytes_slice_mut(member)?;
+                let new_role_idx = remap.remap(member.role_idx());
+                member.set_role_idx(new_role_idx);
+            }
+        }
+        pos += 1 + MEMBER_SIZE;
+    }
+    let mut new_header_data = header_data.clone();
+    {
+        let new_header = Header::from_bytes_slice_mut(&mut new_header_data)?;
+        new_header.set_required_feature_first_idx(new_required_first as u64);
+        new_header.set_optional_feature_first_idx(new_optional_first as u64);
+        let writingprogram_idx = remap.remap(header.writingprogram_idx());
+        new_header.set_writingprogram_idx(writingprogram_idx);
+        let source_idx = remap.remap(header.source_idx());
+        new_header.set_source_idx(source_idx);
+        let base_url_idx = remap.remap(header.osmosis_replication_base_url_idx());
+        new_header.set_osmosis_replication_base_url_idx(base_url_idx);
+    }
+
+    write_resource(archive_dir, "tags", &new_tags_data)?;
+    write_resource(archive_dir, "tags_index", &new_tags_index_data)?;
+    write_resource(archive_dir, "stringtable", &remap.data)?;
+    write_resource(archive_dir, "header", &new_header_data)?;
+    write_resource(archive_dir, "relation_members", &members_data)?;
+    // the auxiliary offsets follow the rebuilt table
+    osmflat::strings::StringOffsets::build(&remap.data).write(archive_dir)?;
+    Ok(())
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+    use flatdata::FileResourceStorage;
+    use std::collections::BTreeSet;
+
+    #[test]
+    fn test_reorder_preserves_tags_and_packs_hot_ones() {
+        let dir = tempfile::tempdir().unwrap();
+        let path = dir.path().join("archive");
+
+        // three tags with reference counts 3/2/1, assigned in reverse order
+        let node_tags: [&[(&str, &str)]; 3] = [
+            &[("rare", "1"), ("building", "yes"), ("highway", "residential")],
+            &[("highway", "residential"), ("building", "yes")],
+            &[("highway", "residential")],
+        ];
+        {
+            let builder = osmflat::OsmBuilder::new(FileResourceStorage::new(path.clone()))
+                .unwrap();
+            let mut strings = vec![0_u8]; // empty string at offset 0
+            let mut string_idx = |s: &str| {
+                let idx = strings.len() as u64;
+                strings.extend_from_slice(s.as_bytes());
+                strings.push(b'\0');
+                idx
+            };
+            let mut tags = builder.start_tags().unwrap();
+            let mut tags_index = builder.start_tags_index().unwrap();
+            let mut tag_idx = std::collections::HashMap::new();
+            let mut nodes = builder.start_nodes().unwrap();
+            for (id, tags_of_node) in node_tags.iter().enumerate() {
+                let node = nodes.grow().unwrap();
+                node.set_id(id as i64);
+                node.set_tag_first_idx(tags_index.len() as u64);
+                for (key, value) in tags_of_node.iter() {
+                    let next_idx = tags.len() as u64;
+                    let idx = *tag_idx.entry((*key, *value)).or_insert(next_idx);
+                    if idx == next_idx {
+                        let tag = tags.grow().unwrap();
+                        tag.set_key_idx(string_idx(key));
+                        tag.set_value_idx(string_idx(value));
+                    }
+                    tags_index.grow().unwrap().set_value(idx);
+                }
+            }
+            let num_tags_index = tags_index.len() as u64;
+            nodes.grow().unwrap().set_tag_first_idx(num_tags_index);
+            nodes.close().unwrap();
+            tags.close().unwrap();
+            tags_index.close().unwrap();
+            let mut ways = builder.start_ways().unwrap();
+            ways.grow().unwrap().set_tag_first_idx(num_tags_index);
+            ways.close().unwrap();
+            builder.start_nodes_index().unwrap().close().unwrap();
+            let mut relations = builder.start_relations().unwrap();
+            relations.grow().unwrap().set_tag_first_idx(num_tags_index);
+            relations.close().unwrap();
+            builder.start_relation_members().unwrap().close().unwrap();
+            builder.set_header(&Header::new()).unwrap();
+            builder.set_stringtable(&strings).unwrap();
+        }
+
+        run(&path).unwrap();
+
+        let archive = osmflat::Osm::open(FileResourceStorage::new(path)).unwrap();
+        // tags are permuted by descending reference count...
+        let decode = |idx: u64| {
+            let tag = &archive.tags()[idx as usize];
+            let strings = archive.stringtable();
+            (
+                String::from_utf8(strings.substring_raw(tag.key_idx() as usize).to_vec())
+                    .unwrap(),
+                String::from_utf8(strings.substring_raw(tag.value_idx() as usize).to_vec())
+                    .unwrap(),
+            )
+        };
+        assert_eq!(decode(0), ("highway".into(), "residential".into()));
+        assert_eq!(decode(1), ("building".into(), "yes".into()));
+        assert_eq!(decode(2), ("rare".into(), "1".into()));
+
+        // ...while every node still carries exactly its tags
+        for (node, tags_of_node) in archive.nodes().iter().zip(&node_tags) {
+            let expected: BTreeSet<(Vec<u8>, Vec<u8>)> = tags_of_node
+                .iter()
+                .map(|(key, value)| (key.as_bytes().to_vec(), value.as_bytes().to_vec()))
+                .collect();
+            let actual: BTreeSet<(Vec<u8>, Vec<u8>)> =
+                osmflat::iter_tags(&archive, node.tags())
+                    .map(|(key, value)| (key.to_vec(), value.to_vec()))
+                    .collect();
+            assert_eq!(actual, expected);
+        }
+    }
+}
@@ -0,0 +1,797 @@
+//! Applies an osmosis change file (`.osc`) to an existing osmflat archive.
+//!
+//! The updated archive is written to a new directory: since all resources are
+//! tightly packed vectors of indices into each other, removing or modifying a
+//! single entity shifts every subsequent index, so the resources are rebuilt
+//! from the source archive instead of patched in place. Entities deleted or
+//! modified by the change file are skipped while copying, modified and created
+//! entities are appended in change file order, and all references are
+//! re-resolved against the resulting id tables.
+
+use crate::args::UpdateArgs;
+use crate::ids;
+use crate::stats::Stats;
+use crate::strings::StringTable;
+use crate::{Error, TagSerializer};
+
+use flatdata::FileResourceStorage;
+use flate2::read::GzDecoder;
+use log::info;
+use osmflat::COORD_SCALE;
+
+use std::collections::HashSet;
+use std::fs;
+use std::io::Read;
+use std::ops::Range;
+use std::str;
+
+/// One tag of an XML document: `<name a="b">`, `</name>` or `<name a="b"/>`.
+#[derive(Debug)]
+enum XmlTag<'a> {
+    Open(&'a str, Vec<(&'a str, String)>),
+    Close(&'a str),
+    Empty(&'a str, Vec<(&'a str, String)>),
+}
+
+/// Minimal pull scanner for the subset of XML used by `.osc` files.
+///
+/// Character data between tags is skipped; comments, processing instructions
+/// and doctype declarations are recognized and ignored.
+struct XmlScanner<'a> {
+    data: &'a str,
+    pos: usize,
+}
+
+fn unescape(s: &str) -> String {
+    if !s.contains('&') {
+        return s.to_string();
+    }
+    let mut result = String::with_capacity(s.len());
+    let mut rest = s;
+    while let Some(amp) = rest.find('&') {
+        result.push_str(&rest[..amp]);
+        rest = &rest[amp..];
+        let entity_end = rest.find(';');
+        match entity_end.map(|end| &rest[..=end]) {
+            Some("&amp;") => result.push('&'),
+            Some("&lt;") => result.push('<'),
+            Some("&gt;") => result.push('>'),
+            Some("&quot;") => result.push('"'),
+            Some("&apos;") => result.push('\''),
+            _ => {
+                // unknown entity: keep it verbatim
+                result.push('&');
+                rest = &rest[1..];
+                continue;
+            }
+        }
+        rest = &rest[entity_end.unwrap() + 1..];
+    }
+    result.push_str(rest);
+    result
+}
+
+impl<'a> XmlScanner<'a> {
+    fn new(data: &'a str) -> Self {
+        Self { data, pos: 0 }
+    }
+
+    /// Returns the next tag, or `None` at the end of the document.
+    fn next_tag(&mut self) -> Result<Option<XmlTag<'a>>, Error> {
+        loop {
+            let rest = &self.data[self.pos..];
+            let lt = match rest.find('<') {
+                Some(lt) => lt,
+                None => return Ok(None),
+            };
+            let rest = &rest[lt..];
+            self.pos += lt;
+
+            let skipped = if rest.starts_with("<!--") {
+                rest.find("-->").map(|end| end + 3)
+            } else if rest.starts_with("<?") {
+                rest.find("?>").map(|end| end + 2)
+            } else if rest.starts_with("<!") {
+                rest.find('>').map(|end| end + 1)
+            } else {
+                return self.parse_element().map(Some);
+            };
+            match skipped {
+                Some(len) => self.pos += len,
+                None => return Err("unterminated XML comment or declaration".into()),
+            }
+        }
+    }
+
+    /// Parses an element tag; `self.pos` points at its `<`.
+    fn parse_element(&mut self) -> Result<XmlTag<'a>, Error> {
+        let bytes = self.data.as_bytes();
+        self.pos += 1; // '<'
+        let closing = bytes.get(self.pos) == Some(&b'/');
+        if closing {
+            self.pos += 1;
+        }
+
+        let name_start = self.pos;
+        while self
+            .data
+            .as_bytes()
+            .get(self.pos)
+            .map_or(false, |&c| !c.is_ascii_whitespace() && c != b'>' && c != b'/')
+        {
+            self.pos += 1;
+        }
+        let name = &self.data[name_start..self.pos];
+        if name.is_empty() {
+            return Err("empty XML element name".into());
+        }
+
+        let mut attrs = Vec::new();
+        loop {
+            while bytes.get(self.pos).map_or(false, |c| c.is_ascii_whitespace()) {
+                self.pos += 1;
+            }
+            match bytes.get(self.pos) {
+                Some(b'>') => {
+                    self.pos += 1;
+                    let tag = if closing {
+                        XmlTag::Close(name)
+                    } else {
+                        XmlTag::Open(name, attrs)
+                    };
+                    return Ok(tag);
+                }
+                Some(b'/') if bytes.get(self.pos + 1) == Some(&b'>') => {
+                    self.pos += 2;
+                    return Ok(XmlTag::Empty(name, attrs));
+                }
+                Some(_) => {
+                    let key_start = self.pos;
+                    while bytes
+                        .get(self.pos)
+                        .map_or(false, |&c| !c.is_ascii_whitespace() && c != b'=')
+                    {
+                        self.pos += 1;
+                    }
+                    let key = &self.data[key_start..self.pos];
+                    while bytes.get(self.pos).map_or(false, |c| c.is_ascii_whitespace()) {
+                        self.pos += 1;
+                    }
+                    if bytes.get(self.pos) != Some(&b'=') {
+                        return Err(format!("expected `=` after attribute `{}`", key).into());
+                    }
+                    self.pos += 1;
+                    while bytes.get(self.pos).map_or(false, |c| c.is_ascii_whitespace()) {
+                        self.pos += 1;
+                    }
+                    let quote = match bytes.get(self.pos) {
+                        Some(&q) if q == b'"' || q == b'\'' => q,
+                        _ => return Err(format!("unquoted value of attribute `{}`", key).into()),
+                    };
+                    self.pos += 1;
+                    let value_start = self.pos;
+                    while bytes.get(self.pos).map_or(false, |&c| c != quote) {
+                        self.pos += 1;
+                    }
+                    if bytes.get(self.pos) != Some(&quote) {
+                        return Err(format!("unterminated value of attribute `{}`", key).into());
+                    }
+                    let value = unescape(&self.data[value_start..self.pos]);
+                    self.pos += 1;
+                    attrs.push((key, value));
+                }
+                None => return Err("unterminated XML element".into()),
+            }
+        }
+    }
+}
+
+#[derive(Debug, Clone, Copy, PartialEq)]
+enum Action {
+    Create,
+    Modify,
+    Delete,
+}
+
+#[derive(Debug, Clone, Copy)]
+enum MemberType {
+    Node,
+    Way,
+    Relation,
+}
+
+#[derive(Debug)]
+struct OscNode {
+    id: i64,
+    lat: i64,
+    lon: i64,
+    tags: Vec<(String, String)>,
+}
+
+#[derive(Debug)]
+struct OscWay {
+    id: i64,
+    refs: Vec<i64>,
+    tags: Vec<(String, String)>,
+}
+
+#[derive(Debug)]
+struct OscMember {
+    member_type: MemberType,
+    member_ref: i64,
+    role: String,
+}
+
+#[derive(Debug)]
+struct OscRelation {
+    id: i64,
+    members: Vec<OscMember>,
+    tags: Vec<(String, String)>,
+}
+
+/// All changes of an `.osc` file, split into the ids to drop from the source
+/// archive and the entities to append.
+///
+/// A modified entity appears in both: its old version is dropped and its new
+/// version appended.
+#[derive(Debug, Default)]
+struct Changeset {
+    removed_nodes: HashSet<i64>,
+    removed_ways: HashSet<i64>,
+    removed_relations: HashSet<i64>,
+    new_nodes: Vec<OscNode>,
+    new_ways: Vec<OscWay>,
+    new_relations: Vec<OscRelation>,
+}
+
+fn attr<'a>(attrs: &'a [(&str, String)], name: &str) -> Result<&'a str, Error> {
+    attrs
+        .iter()
+        .find(|(key, _)| *key == name)
+        .map(|(_, value)| value.as_str())
+        .ok_or_else(|| format!("missing attribute `{}`", name).into())
+}
+
+fn parse_coord(value: &str) -> Result<i64, Error> {
+    let degrees: f64 = value.parse()?;
+    Ok((degrees * COORD_SCALE as f64).round() as i64)
+}
+
+/// Collects `<tag>`, `<nd>` and `<member>` children until the closing tag of
+/// `parent`; for self-closing parents pass `is_empty = true`.
+fn parse_children(
+    scanner: &mut XmlScanner,
+    parent: &str,
+    is_empty: bool,
+    tags: &mut Vec<(String, String)>,
+    refs: &mut Vec<i64>,
+    members: &mut Vec<OscMember>,
+) -> Result<(), Error> {
+    if is_empty {
+        return Ok(());
+    }
+    loop {
+        let tag = scanner
+            .next_tag()?
+            .ok_or_else(|| format!("unexpected end of document inside `{}`", parent))?;
+        match tag {
+            XmlTag::Open("tag", attrs) | XmlTag::Empty("tag", attrs) => {
+                tags.push((attr(&attrs, "k")?.to_string(), attr(&attrs, "v")?.to_string()));
+            }
+            XmlTag::Open("nd", attrs) | XmlTag::Empty("nd", attrs) => {
+                refs.push(attr(&attrs, "ref")?.parse()?);
+            }
+            XmlTag::Open("member", attrs) | XmlTag::Empty("member", attrs) => {
+                let member_type = match attr(&attrs, "type")? {
+                    "node" => MemberType::Node,
+                    "way" => MemberType::Way,
+                    "relation" => MemberType::Relation,
+                    other => return Err(format!("unknown member type `{}`", other).into()),
+                };
+                members.push(OscMember {
+                    member_type,
+                    member_ref: attr(&attrs, "ref")?.parse()?,
+                    role: attr(&attrs, "role").unwrap_or("").to_string(),
+                });
+            }
+            XmlTag::Close(name) if name == parent => return Ok(()),
+            _ => (), // closing tags of children, unknown elements
+        }
+    }
+}
+
+fn parse_osc(document: &str) -> Result<Changeset, Error> {
+    let mut changes = Changeset::default();
+    let mut scanner = XmlScanner::new(document);
+    let mut action = None;
+    while let Some(tag) = scanner.next_tag()? {
+        let (name, attrs, is_empty) = match tag {
+            XmlTag::Open("create", _) => {
+                action = Some(Action::Create);
+                continue;
+            }
+            XmlTag::Open("modify", _) => {
+                action = Some(Action::Modify);
+                continue;
+            }
+            XmlTag::Open("delete", _) => {
+                action = Some(Action::Delete);
+                continue;
+            }
+            XmlTag::Close("create") | XmlTag::Close("modify") | XmlTag::Close("delete") => {
+                action = None;
+                continue;
+            }
+            XmlTag::Open(name, attrs) => (name, attrs, false),
+            XmlTag::Empty(name, attrs) => (name, attrs, true),
+            XmlTag::Close(_) => continue,
+        };
+        if name != "node" && name != "way" && name != "relation" {
+            continue; // osmChange, bounds, ...
+        }
+        let action = action
+            .ok_or_else(|| format!("`{}` outside of <create>/<modify>/<delete>", name))?;
+        let id: i64 = attr(&attrs, "id")?.parse()?;
+
+        let mut tags = Vec::new();
+        let mut refs = Vec::new();
+        let mut members = Vec::new();
+        parse_children(&mut scanner, name, is_empty, &mut tags, &mut refs, &mut members)?;
+
+        let removed = match name {
+            "node" => &mut changes.removed_nodes,
+            "way" => &mut changes.removed_ways,
+            _ => &mut changes.removed_relations,
+        };
+        if action != Action::Create {
+            removed.insert(id);
+        }
+        if action == Action::Delete {
+            continue;
+        }
+        match name {
+            "node" => changes.new_nodes.push(OscNode {
+                id,
+                lat: parse_coord(attr(&attrs, "lat")?)?,
+                lon: parse_coord(attr(&attrs, "lon")?)?,
+                tags,
+            }),
+            "way" => changes.new_ways.push(OscWay { id, refs, tags }),
+            _ => changes.new_relations.push(OscRelation { id, members, tags }),
+        }
+    }
+    Ok(changes)
+}
+
+/// Re-serializes the tags of an entity of the source archive.
+fn copy_tags(
+    archive: &osmflat::Osm,
+    range: Range<u64>,
+    stringtable: &StringTable,
+    tags: &mut TagSerializer,
+) -> Result<(), Error> {
+    for (key, value) in osmflat::iter_tags(archive, range) {
+        tags.serialize(
+            stringtable.insert(str::from_utf8(key)?),
+            stringtable.insert(str::from_utf8(value)?),
+        )?;
+    }
+    Ok(())
+}
+
+fn serialize_tags(
+    entity_tags: &[(String, String)],
+    stringtable: &StringTable,
+    tags: &mut TagSerializer,
+) -> Result<(), Error> {
+    for (key, value) in entity_tags {
+        tags.serialize(stringtable.insert(key), stringtable.insert(value))?;
+    }
+    Ok(())
+}
+
+fn copy_header(
+    archive: &osmflat::Osm,
+    builder: &osmflat::OsmBuilder,
+    stringtable: &StringTable,
+) -> Result<(), Error> {
+    let src = archive.header();
+    let strings = archive.stringtable();
+    let mut header = osmflat::Header::new();
+
+    header.set_bbox_left(src.bbox_left());
+    header.set_bbox_right(src.bbox_right());
+    header.set_bbox_top(src.bbox_top());
+    header.set_bbox_bottom(src.bbox_bottom());
+
+    header.set_required_feature_first_idx(stringtable.next_index());
+    header.set_required_features_size(src.required_features_size());
+    let mut feature_idx = src.required_feature_first_idx() as usize;
+    for _ in 0..src.required_features_size() {
+        let feature = strings.substring(feature_idx)?;
+        feature_idx += feature.len() + 1;
+        stringtable.insert(feature);
+    }
+
+    header.set_optional_feature_first_idx(stringtable.next_index());
+    header.set_optional_features_size(src.optional_features_size());
+    let mut feature_idx = src.optional_feature_first_idx() as usize;
+    for _ in 0..src.optional_features_size() {
+        let feature = strings.substring(feature_idx)?;
+        feature_idx += feature.len() + 1;
+        stringtable.insert(feature);
+    }
+
+    header.set_writingprogram_idx(
+        stringtable.insert(strings.substring(src.writingprogram_idx() as usize)?),
+    );
+    header.set_source_idx(stringtable.insert(strings.substring(src.source_idx() as usize)?));
+    header.set_osmosis_replication_timestamp(src.osmosis_replication_timestamp());
+    header.set_osmosis_replication_sequence_number(src.osmosis_replication_sequence_number());
+    header.set_osmosis_replication_base_url_idx(
+        stringtable.insert(strings.substring(src.osmosis_replication_base_url_idx() as usize)?),
+    );
+
+    builder.set_header(&header)?;
+    Ok(())
+}
+
+fn serialize_nodes(
+    archive: &osmflat::Osm,
+    changes: &Changeset,
+    builder: &osmflat::OsmBuilder,
+    stringtable: &StringTable,
+    tags: &mut TagSerializer,
+    stats: &mut Stats,
+) -> Result<ids::IdTable, Error> {
+    let mut nodes_id_to_idx = ids::IdTableBuilder::new();
+    let mut nodes = builder.start_nodes()?;
+
+    for node in archive.nodes() {
+        if changes.removed_nodes.contains(&node.id()) {
+            continue;
+        }
+        nodes_id_to_idx.insert(node.id() as u64);
+        let new_node = nodes.grow()?;
+        new_node.set_id(node.id());
+        new_node.set_lat(node.lat());
+        new_node.set_lon(node.lon());
+        new_node.set_tag_first_idx(tags.next_index());
+        copy_tags(archive, node.tags(), stringtable, tags)?;
+        stats.num_nodes += 1;
+    }
+    for node in &changes.new_nodes {
+        nodes_id_to_idx.insert(node.id as u64);
+        let new_node = nodes.grow()?;
+        new_node.set_id(node.id);
+        new_node.set_lat(node.lat);
+        new_node.set_lon(node.lon);
+        new_node.set_tag_first_idx(tags.next_index());
+        serialize_tags(&node.tags, stringtable, tags)?;
+        stats.num_nodes += 1;
+    }
+
+    // fill tag_first_idx of the sentry, since it contains the end of the tag
+    // range of the last node
+    nodes.grow()?.set_tag_first_idx(tags.next_index());
+    nodes.close()?;
+    Ok(nodes_id_to_idx.build())
+}
+
+fn serialize_ways(
+    archive: &osmflat::Osm,
+    changes: &Changeset,
+    builder: &osmflat::OsmBuilder,
+    nodes_id_to_idx: &ids::IdTable,
+    stringtable: &StringTable,
+    tags: &mut TagSerializer,
+    stats: &mut Stats,
+) -> Result<ids::IdTable, Error> {
+    let mut ways_id_to_idx = ids::IdTableBuilder::new();
+    let mut ways = builder.start_ways()?;
+    let mut nodes_index = builder.start_nodes_index()?;
+
+    let src_nodes = archive.nodes();
+    let src_nodes_index = archive.nodes_index();
+    // maps an index into the source nodes to an index into the new ones
+    let resolve_node = |src_idx: Option<u64>| -> Option<u64> {
+        src_idx.and_then(|idx| nodes_id_to_idx.get(src_nodes[idx as usize].id() as u64))
+    };
+
+    for way in archive.ways() {
+        if changes.removed_ways.contains(&way.id()) {
+            continue;
+        }
+        ways_id_to_idx.insert(way.id() as u64);
+        let new_way = ways.grow()?;
+        new_way.set_id(way.id());
+        new_way.set_tag_first_idx(tags.next_index());
+        copy_tags(archive, way.tags(), stringtable, tags)?;
+
+        new_way.set_ref_first_idx(nodes_index.len() as u64);
+        for idx in way.refs() {
+            let idx = resolve_node(src_nodes_index[idx as usize].value());
+            stats.num_unresolved_node_ids += idx.is_none() as usize;
+            nodes_index.grow()?.set_value(idx);
+        }
+        stats.num_ways += 1;
+    }
+    for way in &changes.new_ways {
+        ways_id_to_idx.insert(way.id as u64);
+        let new_way = ways.grow()?;
+        new_way.set_id(way.id);
+        new_way.set_tag_first_idx(tags.next_index());
+        serialize_tags(&way.tags, stringtable, tags)?;
+
+        new_way.set_ref_first_idx(nodes_index.len() as u64);
+        for node_ref in &way.refs {
+            let idx = nodes_id_to_idx.get(*node_ref as u64);
+            stats.num_unresolved_node_ids += idx.is_none() as usize;
+            nodes_index.grow()?.set_value(idx);
+        }
+        stats.num_ways += 1;
+    }
+
+    {
+        let sentinel = ways.grow()?;
+        sentinel.set_tag_first_idx(tags.next_index());
+        sentinel.set_ref_first_idx(nodes_index.len() as u64);
+    }
+    ways.close()?;
+    nodes_index.close()?;
+    Ok(ways_id_to_idx.build())
+}
+
+fn serialize_relations(
+    archive: &osmflat::Osm,
+    changes: &Changeset,
+    builder: &osmflat::OsmBuilder,
+    nodes_id_to_idx: &ids::IdTable,
+    ways_id_to_idx: &ids::IdTable,
+    stringtable: &StringTable,
+    tags: &mut TagSerializer,
+    stats: &mut Stats,
+) -> Result<(), Error> {
+    let src_relations = archive.relations();
+
+    // We need to build the index of relation ids first, since relations can
+    // refer again to relations.
+    let mut relations_index_builder = ids::IdTableBuilder::new();
+    for relation in src_relations {
+        if !changes.removed_relations.contains(&relation.id()) {
+            relations_index_builder.insert(relation.id() as u64);
+        }
+    }
+    for relation in &changes.new_relations {
+        relations_index_builder.insert(relation.id as u64);
+    }
+    let relations_id_to_idx = relations_index_builder.build();
+
+    let mut relations = builder.start_relations()?;
+    let mut relation_members = builder.start_relation_members()?;
+
+    let src_strings = archive.stringtable();
+    let src_nodes = archive.nodes();
+    let src_ways = archive.ways();
+
+    for (src_idx, relation) in src_relations.iter().enumerate() {
+        if changes.removed_relations.contains(&relation.id()) {
+            continue;
+        }
+        let new_relation = relations.grow()?;
+        new_relation.set_id(relation.id());
+        new_relation.set_tag_first_idx(tags.next_index());
+        copy_tags(archive, relation.tags(), stringtable, tags)?;
+
+        let mut members = relation_members.grow()?;
+        for member in archive.relation_members().at(src_idx) {
+            match member {
+                osmflat::RelationMembersRef::NodeMember(m) => {
+                    let idx = m
+                        .node_idx()
+                        .and_then(|idx| {
+                            nodes_id_to_idx.get(src_nodes[idx as usize].id() as u64)
+                        });
+                    stats.num_unresolved_node_ids += idx.is_none() as usize;
+                    let new_member = members.add_node_member();
+                    new_member.set_node_idx(idx);
+                    new_member.set_role_idx(
+                        stringtable.insert(src_strings.substring(m.role_idx() as usize)?),
+                    );
+                }
+                osmflat::RelationMembersRef::WayMember(m) => {
+                    let idx = m
+                        .way_idx()
+                        .and_then(|idx| ways_id_to_idx.get(src_ways[idx as usize].id() as u64));
+                    stats.num_unresolved_way_ids += idx.is_none() as usize;
+                    let new_member = members.add_way_member();
+                    new_member.set_way_idx(idx);
+                    new_member.set_role_idx(
+                        stringtable.insert(src_strings.substring(m.role_idx() as usize)?),
+                    );
+                }
+                osmflat::RelationMembersRef::RelationMember(m) => {
+                    let idx = m.relation_idx().and_then(|idx| {
+                        relations_id_to_idx.get(src_relations[idx as usize].id() as u64)
+                    });
+                    stats.num_unresolved_rel_ids += idx.is_none() as usize;
+                    let new_member = members.add_relation_member();
+                    new_member.set_relation_idx(idx);
+                    new_member.set_role_idx(
+                        stringtable.insert(src_strings.substring(m.role_idx() as usize)?),
+                    );
+                }
+            }
+        }
+        stats.num_relations += 1;
+    }
+    for relation in &changes.new_relations {
+        let new_relation = relations.grow()?;
+        new_relation.set_id(relation.id);
+        new_relation.set_tag_first_idx(tags.next_index());
+        serialize_tags(&relation.tags, stringtable, tags)?;
+
+        let mut members = relation_members.grow()?;
+        for member in &relation.members {
+            let role_idx = stringtable.insert(&member.role);
+            match member.member_type {
+                MemberType::Node => {
+                    let idx = nodes_id_to_idx.get(member.member_ref as u64);
+                    stats.num_unresolved_node_ids += idx.is_none() as usize;
+                    let new_member = members.add_node_member();
+                    new_member.set_node_idx(idx);
+                    new_member.set_role_idx(role_idx);
+                }
+                MemberType::Way => {
+                    let idx = ways_id_to_idx.get(member.member_ref as u64);
+                    stats.num_unresolved_way_ids += idx.is_none() as usize;
+                    let new_member = members.add_way_member();
+                    new_member.set_way_idx(idx);
+                    new_member.set_role_idx(role_idx);
+                }
+                MemberType::Relation => {
+                    let idx = relations_id_to_idx.get(member.member_ref as u64);
+                    stats.num_unresolved_rel_ids += idx.is_none() as usize;
+                    let new_member = members.add_relation_member();
+                    new_member.set_relation_idx(idx);
+                    new_member.set_role_idx(role_idx);
+                }
+            }
+        }
+        stats.num_relations += 1;
+    }
+
+    {
+        let sentinel = relations.grow()?;
+        sentinel.set_tag_first_idx(tags.next_index());
+    }
+    relations.close()?;
+    relation_members.close()?;
+    Ok(())
+}
+
+pub fn run(args: &UpdateArgs) -> Result<(), Error> {
+    let raw = fs::read(&args.osc)?;
+    let document = if raw.starts_with(&[0x1f, 0x8b]) {
+        let mut document = String::new();
+        GzDecoder::new(&raw[..]).read_to_string(&mut document)?;
+        document
+    } else {
+        String::from_utf8(raw).map_err(|e| e.utf8_error())?
+    };
+    let changes = parse_osc(&document)?;
+    info!(
+        "Parsed change file: {} new or modified and {} removed or replaced entities.",
+        changes.new_nodes.len() + changes.new_ways.len() + changes.new_relations.len(),
+        changes.removed_nodes.len()
+            + changes.removed_ways.len()
+            + changes.removed_relations.len(),
+    );
+
+    let archive = osmflat::Osm::open(FileResourceStorage::new(args.archive.clone()))?;
+    let builder = osmflat::OsmBuilder::new(FileResourceStorage::new(args.output.clone()))?;
+    let stringtable = StringTable::new()?;
+    let mut tags = TagSerializer::new(&builder)?;
+    let mut stats = Stats::default();
+
+    copy_header(&archive, &builder, &stringtable)?;
+    info!("Header written.");
+
+    let nodes_id_to_idx =
+        serialize_nodes(&archive, &changes, &builder, &stringtable, &mut tags, &mut stats)?;
+    info!("Nodes written.");
+
+    let ways_id_to_idx = serialize_ways(
+        &archive,
+        &changes,
+        &builder,
+        &nodes_id_to_idx,
+        &stringtable,
+        &mut tags,
+        &mut stats,
+    )?;
+    info!("Ways written.");
+
+    serialize_relations(
+        &archive,
+        &changes,
+        &builder,
+        &nodes_id_to_idx,
+        &ways_id_to_idx,
+        &stringtable,
+        &mut tags,
+        &mut stats,
+    )?;
+    info!("Relations written.");
+
+    tags.close(); // drop the reference to stringtable
+    let stringtable_bytes = stringtable.into_bytes()?;
+    builder.set_stringtable(&stringtable_bytes)?;
+    osmflat::strings::StringOffsets::build(&stringtable_bytes).write(&args.output)?;
+
+    info!("Updated archive written to: {}", args.output.display());
+    println!("{}", stats);
+    Ok(())
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    const OSC: &str = r#"<?xml version="1.0" encoding="UTF-8"?>
+<osmChange version="0.6" generator="test">
+  <!-- a comment -->
+  <create>
+    <node id="100" lat="52.5" lon="13.4">
+      <tag k="name" v="A &amp; B"/>
+    </node>
+    <way id="200">
+      <nd ref="100"/>
+      <nd ref="1"/>
+      <tag k="highway" v="residential"/>
+    </way>
+  </create>
+  <modify>
+    <node id="1" lat="48.1" lon="11.5"/>
+  </modify>
+  <delete>
+    <node id="2"/>
+    <relation id="300"/>
+  </delete>
+</osmChange>"#;
+
+    #[test]
+    fn test_parse_osc() {
+        let changes = parse_osc(OSC).unwrap();
+
+        assert_eq!(changes.new_nodes.len(), 2);
+        let created = &changes.new_nodes[0];
+        assert_eq!(created.id, 100);
+        assert_eq!(created.lat, (52.5 * COORD_SCALE as f64) as i64);
+        assert_eq!(created.lon, (13.4 * COORD_SCALE as f64) as i64);
+        assert_eq!(created.tags, vec![("name".to_string(), "A & B".to_string())]);
+
+        let modified = &changes.new_nodes[1];
+        assert_eq!(modified.id, 1);
+        assert!(changes.removed_nodes.contains(&1));
+        assert!(!changes.removed_nodes.contains(&100));
+
+        assert_eq!(changes.new_ways.len(), 1);
+        assert_eq!(changes.new_ways[0].refs, vec![100, 1]);
+        assert_eq!(
+            changes.new_ways[0].tags,
+            vec![("highway".to_string(), "residential".to_string())]
+        );
+
+        assert!(changes.removed_nodes.contains(&2));
+        assert!(changes.removed_relations.contains(&300));
+        assert!(changes.new_relations.is_empty());
+    }
+
+    #[test]
+    fn test_unescape() {
+        assert_eq!(unescape("no entities"), "no entities");
+        assert_eq!(unescape("&lt;&gt;&amp;&quot;&apos;"), "<>&\"'");
+        assert_eq!(unescape("&unknown; rest"), "&unknown; rest");
+    }
+}